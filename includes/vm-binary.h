@@ -0,0 +1,48 @@
+#ifndef HACKVM_BINARY_H
+#define HACKVM_BINARY_H
+
+#include <string>
+#include <vector>
+#include "vm-commands.h"
+
+// VM Binary Format (.vmb)
+// A compact command stream that replaces the pretty printed Pxml between the parser and the translator
+// - the file is memory mapped by the loader, commands are decoded in place
+// - labels are stored once in a string table and referred to by index
+// - all unsigned integers are stored as varints, 7 bits per byte, least significant first, top bit set on all but the last byte
+//
+// Layout
+// file ::=        magic version label_count label* command_count command*
+// magic ::=       'H' 'V' 'M' 'B'
+// version ::=     byte 1
+// label ::=       varint_length bytes
+// command ::=     opcode_byte operands
+//
+// the operands depend on the opcode byte, which is a vm_opcode value
+// vm_operator ::= opcode_byte
+// vm_jump ::=     opcode_byte varint_label_index
+// vm_function ::= opcode_byte varint_label_index varint_number
+// vm_stack ::=    opcode_byte segment_byte varint_offset
+//
+// all errors will result in calls to fatal_error()
+
+// Hack Virtual Machine
+namespace Hack_Virtual_Machine
+{
+    // encode commands as a .vmb byte string
+    extern string vmb_encode(const std::vector<vm_command> &commands) ;
+
+    // write commands to the .vmb file path
+    extern void vmb_write_file(string path,const std::vector<vm_command> &commands) ;
+
+    // decode length bytes of .vmb starting at bytes and pass every command to handler
+    extern void vmb_read_memory(const char *bytes,size_t length,vm_command_handler handler,void *context) ;
+
+    // memory map the .vmb file path and pass every command it contains to handler
+    extern void vmb_read_file(string path,vm_command_handler handler,void *context) ;
+
+    // true if the length bytes starting at bytes begin with the .vmb magic number
+    extern bool vmb_is_binary(const char *bytes,size_t length) ;
+}
+
+#endif //HACKVM_BINARY_H
@@ -0,0 +1,98 @@
+#ifndef HACKVM_COMMANDS_H
+#define HACKVM_COMMANDS_H
+
+#include <string>
+#include <vector>
+#include "abstract-syntax-tree.h"
+
+// VM Commands
+// A flat value type describing one VM command
+// - the translator works on vm_command values rather than AST nodes
+// - vm_command values can be constructed from AST nodes or directly by the readers
+// - command and segment names are held as enumerations so no strings are compared while translating
+// - only commands with a label operand, 'goto', 'if-goto', 'label', 'call' and 'function', use the label field
+
+// all errors encountered by these functions will result in calls to fatal_error() defined in iobuffer.h
+
+// Hack Virtual Machine
+namespace Hack_Virtual_Machine
+{
+    // every VM command, grouped in the same order as the AST grammar
+    enum vm_opcode
+    {
+                        // vm_operator
+        vm_add,
+        vm_and,
+        vm_eq,
+        vm_gt,
+        vm_lt,
+        vm_neg,
+        vm_not,
+        vm_or,
+        vm_sub,
+        vm_return,
+                        // vm_jump
+        vm_goto,
+        vm_if_goto,
+        vm_label,
+                        // vm_function
+        vm_call,
+        vm_function,
+                        // vm_stack
+        vm_push,
+        vm_pop,
+
+        vm_oops         // for error reporting
+    };
+
+    // every VM segment, vm_no_segment is used by commands without a segment
+    enum vm_segment
+    {
+        vm_argument,
+        vm_constant,
+        vm_local,
+        vm_pointer,
+        vm_static,
+        vm_temp,
+        vm_that,
+        vm_this,
+
+        vm_no_segment
+    };
+
+    // a single VM command
+    struct vm_command
+    {
+        vm_opcode op ;          // the command
+        vm_segment segment ;    // the segment of a push or pop
+        int number ;            // the offset of a push or pop, the number of a call or function
+        string label ;          // the label of a jump, call or function
+        int index ;             // the position of the command in its class as read, -1 if unknown
+    } ;
+
+    // command groupings matching the AST node kinds
+    extern bool vm_is_operator(vm_opcode op) ;
+    extern bool vm_is_jump(vm_opcode op) ;
+    extern bool vm_is_function(vm_opcode op) ;
+    extern bool vm_is_stack(vm_opcode op) ;
+
+    // conversion to and from VM language spellings, unknown spellings return vm_oops or vm_no_segment
+    extern string     vm_opcode_to_string(vm_opcode op) ;
+    extern vm_opcode  string_to_vm_opcode(string s) ;
+    extern string     vm_segment_to_string(vm_segment segment) ;
+    extern vm_segment string_to_vm_segment(string s) ;
+
+    // the VM language text of a command, eg "push local 3"
+    extern string vm_command_to_string(const vm_command &command) ;
+
+    // construct commands from AST nodes
+    // command must be one of ast_vm_operator, ast_vm_jump, ast_vm_function or ast_vm_stack
+    // root must be an ast_vm_class node
+    extern vm_command vm_command_from_ast(ast command) ;
+    extern std::vector<vm_command> vm_commands_from_ast(ast root) ;
+
+    // a function called once for each command read, context is passed through unchanged
+    typedef void (*vm_command_handler)(const vm_command &command,void *context) ;
+}
+
+#endif //HACKVM_COMMANDS_H
@@ -0,0 +1,41 @@
+#ifndef HACKVM_LABELS_H
+#define HACKVM_LABELS_H
+
+#include <string>
+#include "vm-commands.h"
+
+// VM Labels
+// The labels of the function being translated, interned in a CS_Symbol_Tables int table
+// - each label is given a small integer id the first time it is seen in a function
+// - the Hack assembly name of a label, Class.func$label, is built once when the label is interned
+// - every definition and jump is recorded so duplicate and undefined labels are reported by the translator
+//   rather than by the assembler
+// - jumps to labels a function does not define are only errors in whole program output, the checked
+//   per command output allows a jump to be tested without its target
+//
+// all errors will result in calls to fatal_error()
+
+// the function that labels seen before the first function command belong to
+#define VM_UNKNOWN_FUNCTION "Unknown.unknown"
+
+// Hack Virtual Machine
+namespace Hack_Virtual_Machine
+{
+    // forget the labels of the previous function, function is the full name, eg Main.main
+    extern void vm_labels_start_function(string function) ;
+
+    // finish the current function and forget its labels, if check_jumps is true a jump to a label it never defines is an error
+    extern void vm_labels_end_function(bool check_jumps) ;
+
+    // the id of label in the current function, interning it if it has not been seen before
+    extern int vm_label_id(const string &label) ;
+
+    // the Hack assembly name of label id, eg Main.main$WHILE_EXP0
+    extern const string &vm_label_name(int id) ;
+
+    // record a label command or a goto / if-goto, a second definition of a label is an error
+    extern void vm_label_defined(int id) ;
+    extern void vm_label_jumped_to(int id) ;
+}
+
+#endif //HACKVM_LABELS_H
@@ -0,0 +1,44 @@
+#ifndef HACKVM_PROGRAM_H
+#define HACKVM_PROGRAM_H
+
+#include <string>
+#include "vm-commands.h"
+
+// VM Programs
+// A summary of every function of a whole program, read from the Pxml or .vmb files of all of its classes
+// - the program is named by a list file, one class file per line, blank lines and lines starting with # are ignored
+// - the translator still translates one class at a time, the summary tells it about the functions of the other classes
+// - a function's arguments are the number passed by its calls, there are no other callers in a whole program
+// - the stack depth is followed through each function, it is balanced if the stack is empty at every label
+//   and jump and holds just the result at every return, as it always is in the Jack compiler's output
+//
+// all errors will result in calls to fatal_error()
+
+// Hack Virtual Machine
+namespace Hack_Virtual_Machine
+{
+    // what the program's commands say about one function
+    struct vm_function_summary
+    {
+        string name ;           // the full name, eg Main.main
+        int locals ;            // the number of the function command
+        int arguments ;         // the number passed by every call, -1 if it is never called, -2 if the calls disagree
+        int arguments_used ;    // one more than the highest argument pushed or popped
+        int locals_used ;       // one more than the highest local pushed or popped
+        bool calls ;            // false for a leaf function
+        bool balanced ;         // the stack depth is as the Jack compiler leaves it
+        bool pops_this ;        // pop pointer 0 changes THIS
+        bool pops_that ;        // pop pointer 1 changes THAT
+    } ;
+
+    // read the class files named in the list file path, replacing any program read before
+    extern void vm_program_read(string path) ;
+
+    // forget the program
+    extern void vm_program_clear() ;
+
+    // the summary of the function name, 0 if no class of the program defines it
+    extern const vm_function_summary *vm_program_function(const string &name) ;
+}
+
+#endif //HACKVM_PROGRAM_H
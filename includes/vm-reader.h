@@ -0,0 +1,46 @@
+#ifndef HACKVM_READER_H
+#define HACKVM_READER_H
+
+#include <string>
+#include <vector>
+#include "vm-commands.h"
+
+// Pxml Reader
+// A fast alternative to ast_parse_xml() that only recognises the fixed <vm-class> schema
+// - the input file is memory mapped and scanned in place, no XML tokens or AST nodes are created
+// - pretty printed indents are ignored
+// - each command is passed to the handler as soon as its closing tag has been read
+// - the only strings constructed are the labels of jump, call and function commands
+// - documents of 1MB or more can be scanned by several threads, each scanning whole functions, see vm-reader.cpp,
+//   the handler is still called on the calling thread in document order and the results are the same as a serial scan
+//
+// The schema recognised, the first form of each field is the one written by bin/parser
+// vm_class ::=    '<vm-class>' vm_command* '</vm-class>' | '<vm-class/>'
+// vm_command ::=  vm_operator | vm_jump | vm_function | vm_stack
+// vm_operator ::= '<vm-operator>' command '</vm-operator>'
+// vm_jump ::=     '<vm-jump>' command label '</vm-jump>'
+// vm_function ::= '<vm-function>' command label number '</vm-function>'
+// vm_stack ::=    '<vm-stack>' command segment offset '</vm-stack>'
+// command ::=     '<command>' text '</command>'
+// label ::=       '<label>' text '</label>'
+// number ::=      '<number>' digits '</number>'
+// segment ::=     '<segment>' text '</segment>'
+// offset ::=      '<offset>' digits '</offset>'
+
+// all errors will result in calls to fatal_error(), the message includes the line number of the error
+
+// Hack Virtual Machine
+namespace Hack_Virtual_Machine
+{
+    // memory map the Pxml file path and pass every command it contains to handler
+    // threads is the most threads that may scan the document, 0 means one per processor
+    extern void pxml_read_file(string path,vm_command_handler handler,void *context,int threads = 1) ;
+
+    // scan length bytes of Pxml starting at text and pass every command found to handler
+    extern void pxml_read_memory(const char *text,size_t length,vm_command_handler handler,void *context,int threads = 1) ;
+
+    // encode commands as Pxml using the same layout as ast_print_as_xml() with an indent of 4
+    extern string pxml_encode(const std::vector<vm_command> &commands) ;
+}
+
+#endif //HACKVM_READER_H
@@ -2,11 +2,30 @@
 #include "iobuffer.h"
 #include "abstract-syntax-tree.h"
 #include "assembler-internal.h"
+#include "vm-commands.h"
+#include "vm-reader.h"
+#include "vm-binary.h"
+#include "vm-labels.h"
+#include "vm-program.h"
+#include "symbols.h"
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
  
 // to make out programs a bit neater
 using namespace std ;
 
 using namespace CS_IO_Buffers ;
+using namespace CS_Symbol_Tables ;
 using namespace Hack_Virtual_Machine ;
 
 // grammer to be parsed:
@@ -19,11 +38,15 @@ using namespace Hack_Virtual_Machine ;
 
 // forward declare parsing functions - one per rule
 static void translate_vm_class(ast root) ;
-static void translate_vm_command(ast command) ;
-static void translate_vm_operator(ast vm_op) ;
-static void translate_vm_jump(ast jump) ;
-static void translate_vm_func(ast func) ;
-static void translate_vm_stack(ast stack) ;
+static void translate_vm_file(string path) ;
+static void translate_vm_memory(const char *bytes,size_t length) ;
+static void buffer_vm_command(const vm_command &command) ;
+static void translate_vm_function() ;
+static void translate_vm_command(const vm_command &command) ;
+static void translate_vm_operator(const vm_command &vm_op) ;
+static void translate_vm_jump(const vm_command &jump) ;
+static void translate_vm_func(const vm_command &func) ;
+static void translate_vm_stack(const vm_command &stack) ;
 
 
 
@@ -58,12 +81,204 @@ enum CompareToken{
 // class_name and function_name 
 static string class_name = "Unknown";
 static string function_name = "unknown";
+// class_name + "." + function_name + "$", rebuilt only when either changes
+static string label_prefix = VM_UNKNOWN_FUNCTION "$";
 
 // counter
 static int counter = 0;
 
+// output control
+// by default every instruction goes through output_assembler() which checks each VM command on its own
+// code shared between VM commands cannot pass those checks so options that need it write plain Hack assembly
+static bool assembly_output = false;
+// the ROM address of the next instruction, counted from the start of the translation
+static int rom_address = 0;
+
+// optimisation levels and the cost model
+// a construct with more than one lowering asks cheaper() whether an alternative beats its fixed lowering
+//   -O0  nothing is weighed, every construct uses its fixed lowering
+//   -O1  weigh for speed and --hoist, only changes that keep each VM command on its own so the checked output still works
+//   -O2  -O1 plus --asm, --intrinsics, --forward-stores, --jump-tables and --cache-fields
+//   -Os  weigh for size, shared routines, string tables, forwarded stores, jump tables, cached fields and one epilogue per class, implies --asm
+// with a profile, functions that are cold are always weighed for size
+enum cost_weighting { weigh_nothing, weigh_speed, weigh_size };
+static cost_weighting level_weighting = weigh_nothing;
+
+// the cost of one use of a lowering, the instructions emitted at the use and the cycles it executes
+// shared routines are emitted once per class so their bodies only count as cycles
+struct lowering_cost
+{
+    int instructions;
+    int cycles;
+};
+static const lowering_cost inline_call_cost = { 44, 44 };
+static const lowering_cost shared_call_cost = { 14, 14 + 43 };
+static const lowering_cost inline_compare_cost = { 21, 14 };
+static const lowering_cost shared_compare_cost = { 6, 6 + 13 };
+static const lowering_cost inline_return_cost = { 51, 51 };
+static const lowering_cost shared_return_cost = { 2, 2 + 51 };
+
+// source map
+// each VM command, and each shared routine, is recorded as one line of the source map:
+//   <first ROM address> <ROM address after the last> <class> <function> <command index> <command>
+// labels produce no instructions so their first and after the last addresses are equal
+// shared routines have a function of - and a command index of -1
+// a function that --program calls without a full frame also gets a line before its commands:
+//   # frame <function> <words pushed by a call, 0 for a register leaf> <arguments passed by every call>
+static string source_map_file = "";
+static string source_map = "";
+static int command_start_address = 0;
+static vm_command current_command;
+
+// metrics report
+// with --metrics=<file> a JSON report of where translation time went and how much code each kind of VM command cost
+// the wall time is split into phases: parse is reading the input, translate is the translation of the commands
+// and output is writing the output and any other files, the streaming readers switch between parse and translate
+// for every command, peak memory is the process's maximum resident set size
+enum metrics_phase { phase_parse, phase_translate, phase_output, phase_none };
+struct region_metrics
+{
+    int count;
+    int instructions;
+};
+static string metrics_file = "";
+static metrics_phase current_phase = phase_none;
+static double phase_started = 0;
+static double phase_seconds[phase_none];
+static region_metrics command_metrics[vm_oops][vm_no_segment + 1];
+static vector<pair<string,region_metrics> > shared_metrics;
+
+// shared routines used by the current class, they are written after its last VM command
+// there is a shared call routine for each kind of frame, see reduced frames below
+static bool shared_call_used[4] = { false, false, false, false };
+static bool shared_compare_used[3] = { false, false, false };
+static bool shared_multiply_used = false;
+static bool shared_append_used = false;
+
+// string literals compile to push constant n ; call String.new 1 followed by a
+// push constant c ; call String.appendChar 2 pair for each character
+// string tables replace the pairs with a table of characters consumed by one shared routine
+static bool use_string_tables = false;
+#define STRING_TABLE_MINIMUM 2
+#define STRING_TABLE_ENTRY_SIZE 4
+
+// shared returns
+// the first return in each function, or in each class, is labelled and later returns jump to it
+// this trades a 2 instruction jump on every later return for about 50 instructions of code each
+// functions only share a return with functions that have the same kind of frame
+enum return_sharing { return_inline, return_per_function, return_per_class };
+static return_sharing shared_returns = return_inline;
+static string shared_return_label[4];
+
+// function prologues
+// locals are zeroed by one of three forms, the cheapest for the current weighting is used:
+//   unrolled: a push 0 per local
+//   bulk:     walk A over the new locals storing 0 then add n to SP
+//             with --asm, locals written before being read are not zeroed, the checked output must zero every local
+//   loop:     a push 0 loop counted down in D
+// the default is always unrolled, weigh_speed prefers fewer cycles, weigh_size fewer instructions
+// with a profile, cold functions are weighed for size
+static cost_weighting prologue = weigh_nothing;
+// locals_written_first[k] is true if local k is popped before any push of it in the function's first basic block
+static vector<bool> locals_written_first;
+// the simulator runs at most 200 instructions of a checked VM command, longer loops are not used
+#define PROLOGUE_CHECKED_CYCLES 200
+
+// loop invariant hoisting, see hoist_loop_invariants()
+static bool hoist_invariants = false;
+
+// this and that field address caching
+// within straight line code R15 holds cached_base + cached_offset, the address of the last field that was
+// accessed when another access through the same base follows, later accesses step A from it
+static bool cache_fields = false;
+static int cached_base = -1;
+static int cached_offset = 0;
+static bool field_cache_wanted = false;
+
+// copy propagation and dead temp stores, see find_stack_rewrites()
+enum stack_rewrite
+{
+    rewrite_none,           // translated as usual
+    rewrite_copy,           // pop X ; push X, the value stays on the stack and is copied to X
+    rewrite_drop,           // pop temp k ; push temp k with temp k dead afterwards, nothing is emitted
+    rewrite_discard,        // pop temp k with temp k dead, SP--
+    rewrite_array_store,    // pop temp k ; pop pointer 1 ; push temp k ; pop that 0 without the reload of temp k
+    rewrite_jump_table,     // the if-goto of the first test of a chain of tests, see find_jump_tables()
+    rewrite_skip            // part of an earlier rewrite, nothing is emitted
+};
+static bool forward_stores = false;
+
+// jump tables
+// a chain of else if tests of one location against constants jumps through a table instead of testing each constant in turn
+// the value is checked against the smallest and largest constants then a computed jump lands on an @target ; 0;JMP entry
+struct jump_table
+{
+    vector<pair<int,string> > cases;    // each constant and the label it jumps to, the first test of a constant wins
+    string otherwise;                   // the label reached when no constant matches
+};
+static bool use_jump_tables = false;
+static vector<jump_table> jump_tables;
+static size_t next_jump_table = 0;
+#define JUMP_TABLE_MINIMUM 3
+#define JUMP_TABLE_DENSITY 4
+
+// intrinsics replace calls of some OS functions with inline code or a shared routine with the same stack effect
+static bool use_intrinsics = false;
+
+// whole program calling convention
+// with --program=<file> every class of the program is known so a function called only by the program can change how it is called
+// a leaf function with at most LEAF_ARGUMENTS arguments and LEAF_LOCALS locals, other than Sys.init and Main.main, gets no frame:
+//   call:     the arguments are popped into leaf..arg<i>, D = return address, jump
+//   function: leaf..return = D, THIS and THAT are saved in leaf..this and leaf..that if the function pops them, locals are zeroed
+//   return:   the result is already on top of the stack in place of the arguments, THIS and THAT are restored, jump to leaf..return
+// arguments and locals are read and written in leaf..arg<i> and leaf..local<i> rather than through ARG and LCL
+// a leaf calls nothing so at most one is running at a time and every leaf shares the same cells
+// the cells are assembler variables, R13 to R15 cannot hold them as the body uses them as scratch
+static bool whole_program = false;
+static bool in_register_leaf = false;
+#define LEAF_ARGUMENTS 2
+#define LEAF_LOCALS 4
+
+// reduced frames
+// a frame saves the caller's LCL and ARG and only the pointers the callee changes, frame bit 1 is THIS and bit 2 is THAT:
+//   call:   push return, LCL, ARG, [THIS], [THAT] ; ARG = SP - n - frame_size() ; LCL = SP
+//   return: restore the saved registers from the top of the frame down, the return address is at LCL - frame_size()
+// every function restores what it changes so a call never changes the caller's pointers,
+// a function's frame only needs the pointers its own commands pop, nothing its callees do can reach them
+// without --program, and for Sys.init, Main.main and functions the program never calls, the frame saves both
+// -Os shares every call and return, a shared routine for each kind of frame would only add code so -Os keeps full frames
+#define FULL_FRAME 3
+static int current_frame = FULL_FRAME;
+
+// profile guided optimisation
+// a profile is a text file of execution counts recorded by an instrumented run, one count per line:
+//   Class.func <count>         the number of times the function was entered
+//   Class.func$label <count>   the number of times the label was reached
+// blank lines and lines starting with # are ignored, missing functions and labels have a count of 0
+static bool profile_loaded = false;
+static symbols profile_counts;
+// a function is hot if it was entered at least 1/PROFILE_HOT_RATIO times as often as the hottest function
+#define PROFILE_HOT_RATIO 100
+static int profile_hot_threshold = 1;
+
+// runtime instrumentation
+// each counter is one word of RAM incremented by @address ; M=M+1, counters start at counter_base
+// counters are keyed like a profile, Class.func counts entries, Class.func$label counts arrivals at a label
+// and Class.func>Callee counts calls from Class.func to Callee
+// the default region is the top 512 words of the Jack OS heap (2048..16383), the OS does not reserve it,
+// so Memory.alloc can hand out the same words and a program that allocates heavily corrupts its counters
+// or has its objects changed by them, --counter-base can move the counters somewhere the program never uses
+static bool instrument_functions = false;
+static bool instrument_labels = false;
+static string instrument_manifest = "";
+#define COUNTER_BASE 15872
+#define COUNTER_LIMIT 16384
+static int counter_base = COUNTER_BASE;
+static symbols counter_addresses;
+static vector<string> counter_keys;
+
 // function
-static string get_prefix();
+static const string &get_prefix();
 static string get_class_name();
 static void set_function_name(string func);
 static void set_class_name(string cla);
@@ -72,7 +287,11 @@ static void jmp_label(string label);
 static void updata_counter();
 static string get_counter();
 static void output_function(string label,int number);
+static void output_return();
+static void output_prologue(int number);
+static void find_locals_written_first(vector<vm_command> &commands,size_t function);
 static void output_call(string label,int number);
+static void inline_call(string label,int number);
 static void op_add();
 static void op_sub();
 static void push_register(register_name rn);
@@ -100,21 +319,187 @@ static void pop_pointer(int number);
 static void push_pointer(int number);
 static void push_temp(int number);
 static void pop_static(int number);
+static void push_segment(register_name rn,int offset);
+static bool output_cached_field(register_name rn,int offset,bool push);
+static void pop_segment(register_name rn,int offset);
+static void push_constant_lowered(int number);
+static void push_static_lowered(int number);
 static void Compare(CompareToken ct);
+static void output_asm(string instruction);
+static void start_of_class();
+static void end_of_class();
+static void start_of_command(const vm_command &command);
+static void end_of_command();
+static bool field_cache_clobbered(const vm_command &command);
+static bool field_reused(vector<vm_command> &commands,vector<stack_rewrite> &rewrites,size_t i);
+static void read_profile(string path);
+static int profile_count(string key);
+static bool use_shared_routines();
+static cost_weighting current_weighting();
+static bool cheaper(cost_weighting weighting,lowering_cost a,lowering_cost b);
+static void layout_cold_branches(vector<vm_command> &commands);
+static void hoist_loop_invariants(vector<vm_command> &commands);
+static bool same_location(const vm_command &a,const vm_command &b);
+static string shared_call_label(int frame);
+static string shared_compare_label(CompareToken ct);
+static void output_shared_routines();
+static void call_shared_routine(string routine);
+static bool output_intrinsic(string label,int number);
+static int string_table_length(vector<vm_command> &commands,size_t i);
+static void output_string_table_start();
+static void output_string_table_entry(int character);
+static void output_counter(string key);
+static bool register_leaf(const string &name);
+static string leaf_cell(const vm_command &command);
+static void leaf_call(string label,int number);
+static void leaf_entry(string label,int number);
+static void leaf_return();
+static int function_frame(const string &name);
+static int frame_size(int frame);
+static string frame_suffix(int frame);
+static lowering_cost frame_cost(lowering_cost full,int frame,int instructions,int cycles);
+static void find_stack_rewrites(vector<vm_command> &commands,vector<stack_rewrite> &rewrites);
+static void output_stack_rewrite(const vm_command &command,stack_rewrite rewrite);
+static void find_jump_tables(vector<vm_command> &commands,vector<stack_rewrite> &rewrites);
+static void output_jump_table(const jump_table &table);
+static void write_instrument_manifest();
+static void write_source_map();
+static void write_metrics();
+
+
+
+// output control
+// while the templates are checked the helpers' instructions are collected here instead of being output
+static string *captured_asm = 0;
+static void output_asm(string instruction){
+    if (captured_asm != 0){
+        *captured_asm += instruction + "\n";
+        return;
+    }
+    if (assembly_output){
+        write_to_output(instruction + "\n");
+    }else{
+        output_assembler(instruction);
+    }
+    if (instruction[0] != '(' && instruction.compare(0,2,"//") != 0){
+        rom_address++;
+    }
+}
+static void source_map_region(int start,string function,int index,string text){
+    if (source_map_file != ""){
+        source_map += to_string(start) + " " + to_string(rom_address) + " " + get_class_name() + " " +
+                      function + " " + to_string(index) + " " + text + "\n";
+    }
+}
+static void add_region_metrics(region_metrics &metrics,int start){
+    metrics.count++;
+    metrics.instructions += rom_address - start;
+}
+// a shared routine of the current class has just been written starting at ROM address start
+static void shared_routine_region(int start,string name){
+    source_map_region(start,"-",-1,name);
+    if (metrics_file == ""){
+        return;
+    }
+    for (size_t i = 0; i < shared_metrics.size(); i++){
+        if (shared_metrics[i].first == name){
+            add_region_metrics(shared_metrics[i].second,start);
+            return;
+        }
+    }
+    region_metrics none = { 0, 0 };
+    shared_metrics.push_back(make_pair(name,none));
+    add_region_metrics(shared_metrics.back().second,start);
+}
+static double wall_seconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+// charge the time since the last call to the current phase and start the next one
+static void start_phase(metrics_phase phase){
+    if (metrics_file == "" || phase == current_phase){
+        return;
+    }
+    double now = wall_seconds();
+    if (current_phase != phase_none){
+        phase_seconds[current_phase] += now - phase_started;
+    }
+    current_phase = phase;
+    phase_started = now;
+}
+static void start_of_class(){
+    for (int frame = 0; frame <= FULL_FRAME; frame++){
+        shared_call_used[frame] = false;
+        shared_return_label[frame] = "";
+    }
+    for (int i = 0; i < 3; i++){
+        shared_compare_used[i] = false;
+    }
+    shared_multiply_used = false;
+    shared_append_used = false;
+    if (!assembly_output){
+        start_of_vm_class();
+    }
+}
+static void end_of_class(){
+    start_phase(phase_translate);
+    vm_labels_end_function(assembly_output);
+    if (assembly_output){
+        output_shared_routines();
+    }else{
+        end_of_vm_class();
+    }
+}
+static void start_of_command(const vm_command &command){
+    command_start_address = rom_address;
+    current_command = command;
+    if (field_cache_clobbered(command)){
+        cached_base = -1;
+    }
+    if (assembly_output){
+        return;
+    }
+    string the_op = vm_opcode_to_string(command.op);
+    if (vm_is_operator(command.op)){
+        start_of_vm_operator_command(the_op);
+    }else if (vm_is_jump(command.op)){
+        start_of_vm_jump_command(the_op,command.label);
+    }else if (vm_is_function(command.op)){
+        start_of_vm_func_command(the_op,command.label,command.number);
+    }else{
+        start_of_vm_stack_command(the_op,vm_segment_to_string(command.segment),command.number);
+    }
+}
+static void end_of_command(){
+    source_map_region(command_start_address,function_name == "unknown" ? "-" : get_class_name() + "." + function_name,
+                      current_command.index,vm_command_to_string(current_command));
+    if (metrics_file != ""){
+        vm_segment segment = vm_is_stack(current_command.op) ? current_command.segment : vm_no_segment;
+        add_region_metrics(command_metrics[current_command.op][segment],command_start_address);
+    }
+    if (!assembly_output){
+        end_of_vm_command();
+        // output_assembler() adds a no-op instruction after a VM command with no instructions
+        if (rom_address == command_start_address){
+            rom_address++;
+        }
+    }
+}
 
-
-
-static string get_prefix(){
-    return class_name + "." + function_name + "$";
+static const string &get_prefix(){
+    return label_prefix;
 }
 static string get_class_name(){
     return class_name;
 }
 static void set_function_name(string func){
     function_name = func;
+    label_prefix = class_name + "." + function_name + "$";
 }
 static void set_class_name(string cla){
     class_name = cla;
+    label_prefix = class_name + "." + function_name + "$";
 }
 static void set_class_and_function_name(string label){
     const char * ch= label.c_str();
@@ -138,10 +523,10 @@ static string get_counter(){
 
 // label function
 static void output_label (string label){
-    output_assembler("("+label+")") ; 
+    output_asm("("+label+")") ; 
 }
 static void A_instructions(string label){
-    output_assembler("@" + label) ; 
+    output_asm("@" + label) ; 
 }
 static void register_to_A(register_name rn){
     A_instructions("R"+to_string(rn)); 
@@ -158,83 +543,93 @@ static string get_temp_label(){
 static void two_operands(){
     // D = *(SP - 1), A = SP - 2
     register_to_A(SP);
-	output_assembler("AM=M-1"); 
-	output_assembler("D=M"); 
-	output_assembler("A=A-1"); 
+	output_asm("AM=M-1"); 
+	output_asm("D=M"); 
+	output_asm("A=A-1"); 
 }
 static void op_add(){
     two_operands(); 
-	output_assembler("M=D+M"); 
+	output_asm("M=D+M"); 
 }
 static void op_sub(){
     two_operands(); 
-	output_assembler("M=M-D"); // *(SP - 2) = *(SP - 2) - *(SP - 1)
+	output_asm("M=M-D"); // *(SP - 2) = *(SP - 2) - *(SP - 1)
 }
 
 static void op_return(){
     // FRAME = LCL
 	register_to_A(LCL);
-	output_assembler("D=M"); 
+	output_asm("D=M"); 
 	register_to_A(R14);
-	output_assembler("M=D");
-    // RET = *(FRAME - 5)
-    A_instructions("5");
-    output_assembler("D=D-A");
-    output_assembler("A=D");
-    output_assembler("D=M");
+	output_asm("M=D");
+    // RET = *(FRAME - 5), less for a reduced frame
+    A_instructions(to_string(frame_size(current_frame)));
+    output_asm("D=D-A");
+    output_asm("A=D");
+    output_asm("D=M");
     register_to_A(R13);
-    output_assembler("M=D");
+    output_asm("M=D");
     // *ARG = Pop()
     pop_D();
     register_to_A(ARG);
-    output_assembler("A=M"); // A = ARG
-    output_assembler("M=D");
+    output_asm("A=M"); // A = ARG
+    output_asm("M=D");
     // SP = ARG + 1 
     register_to_A(ARG); // A = &ARG
-	output_assembler("D=M+1"); // D = ARG + 1
+	output_asm("D=M+1"); // D = ARG + 1
 	register_to_A(SP); // A = &SP
-	output_assembler("M=D"); // SP = ARG + 1
-    for (int i = 1; i <= 4; i++){
+	output_asm("M=D"); // SP = ARG + 1
+    // the saved registers from the top of the frame down
+    vector<register_name> saved;
+    if (current_frame & 2){
+        saved.push_back(THAT);
+    }
+    if (current_frame & 1){
+        saved.push_back(THIS);
+    }
+    saved.push_back(ARG);
+    saved.push_back(LCL);
+    for (int i = 1; i <= (int)saved.size(); i++){
         register_to_A(R14); 
-        output_assembler("D=M"); 
+        output_asm("D=M"); 
         A_instructions(to_string(i));
-        output_assembler("A=D-A");
-        output_assembler("D=M"); 
-        register_to_A((register_name)(5 - i));
-        output_assembler("M=D"); 
+        output_asm("A=D-A");
+        output_asm("D=M"); 
+        register_to_A(saved[i - 1]);
+        output_asm("M=D"); 
     }
     jmp_register(R13);
 }
 void change_stack_top_true(){
     A_instructions("32767");
-	output_assembler("AD=A");
-	output_assembler("D=D+A");
-    output_assembler("D=D+1"); 
+	output_asm("AD=A");
+	output_asm("D=D+A");
+    output_asm("D=D+1"); 
 	register_to_A(SP);
-	output_assembler("A=M-1");
-	output_assembler("M=D");
+	output_asm("A=M-1");
+	output_asm("M=D");
 }
 void change_stack_top_false(){
     A_instructions("0");
-	output_assembler("D=A");
+	output_asm("D=A");
 	register_to_A(SP); 
-	output_assembler("A=M-1");
-	output_assembler("M=D");
+	output_asm("A=M-1");
+	output_asm("M=D");
 }
 
 static void op_or(){
     two_operands();
-    output_assembler("M=D|M"); 
+    output_asm("M=D|M"); 
 }
 static void op_not(){
     register_to_A(SP); 
-	output_assembler("A=M-1");
-	output_assembler("M=!M"); 
+	output_asm("A=M-1");
+	output_asm("M=!M"); 
 }
 static void op_neg(){
     register_to_A(SP); 
-	output_assembler("A=M-1"); 
-	output_assembler("M=-M");
+	output_asm("A=M-1"); 
+	output_asm("M=-M");
 }
 static void op_lt(){
     Compare(LT);
@@ -247,19 +642,24 @@ static void op_eq(){
 }
 static void op_and(){
     two_operands();
-    output_assembler("M=D&M");
+    output_asm("M=D&M");
 }
 static void Compare(CompareToken ct){
+    if (cheaper(current_weighting(),shared_compare_cost,inline_compare_cost)){
+        call_shared_routine(shared_compare_label(ct));
+        shared_compare_used[ct - LT] = true;
+        return;
+    }
     two_operands();
     // D = *(SP - 1), A = SP - 2
-    output_assembler("D=M-D"); 
+    output_asm("D=M-D"); 
     A_instructions(get_temp_label());
     if (ct == LT){
-        output_assembler("D;JLT");
+        output_asm("D;JLT");
     }else if (ct == GT){
-        output_assembler("D;JGT");
+        output_asm("D;JGT");
     }else{// eq
-        output_assembler("D;JEQ");
+        output_asm("D;JEQ");
     }
 
     // if true
@@ -274,54 +674,46 @@ static void Compare(CompareToken ct){
     updata_counter();
 }
 // jmp
-static void output_if_goto(string label){
-    pop_D();
-    A_instructions(get_prefix()+label);
-    output_assembler("D;JNE") ;
-}
-static void output_goto(string label){
-    jmp_label(get_prefix()+label);
-}
 static void jmp_label(string label){
     A_instructions(label) ;
-    output_assembler("0;JMP") ;
+    output_asm("0;JMP") ;
 }
 static void jmp_register(register_name rn){
     A_instructions("R"+to_string(rn)); 
-    output_assembler("A=M"); 
-	output_assembler("0;JMP");
+    output_asm("A=M"); 
+	output_asm("0;JMP");
 }
 // push 
 static void push_register(register_name rn){
     A_instructions("R"+to_string(rn)); 
-	output_assembler("D=M"); 
+	output_asm("D=M"); 
 	push_D();
 }
 static void push_0(){
     // push 0
     register_to_A(SP);
-	output_assembler("D=A");
-	output_assembler("AM=M+1");
-	output_assembler("A=A-1");
-	output_assembler("M=D");
+	output_asm("D=A");
+	output_asm("AM=M+1");
+	output_asm("A=A-1");
+	output_asm("M=D");
 }
 static void push_A(){
-    output_assembler("D=A");
+    output_asm("D=A");
     push_D();
 }
 static void push_D (){
     register_to_A(SP);
-	output_assembler("AM=M+1");
-	output_assembler("A=A-1");
-	output_assembler("M=D");
+	output_asm("AM=M+1");
+	output_asm("A=A-1");
+	output_asm("M=D");
 }
 static void push_address_offset_value(register_name rn, int offset){
 	register_to_A(rn);
-	output_assembler("A=M"); // A = ARG
-	output_assembler("D=A");  // D = ARG
+	output_asm("A=M"); // A = ARG
+	output_asm("D=A");  // D = ARG
 	A_instructions(to_string(offset));
-	output_assembler("A=D+A"); // A = ARG + offset 
-	output_assembler("D=M"); 
+	output_asm("A=D+A"); // A = ARG + offset 
+	output_asm("D=M"); 
 	push_D(); 
 }
 
@@ -331,7 +723,7 @@ static void push_constant(int number){
 }
 static void push_static(int number){
     A_instructions(get_class_name()+"."+to_string(number));
-    output_assembler("A=M");
+    output_asm("A=M");
 	push_A();
 }
 static void push_pointer(int number){
@@ -349,74 +741,565 @@ static void pop_pointer(int number){
 }
 static void pop_address_offset_value(register_name rn, int offset){
 	register_to_A(rn); // A = &ARG
-	output_assembler("A=M"); // A = ARG
-	output_assembler("D=A");  // D = ARG
+	output_asm("A=M"); // A = ARG
+	output_asm("D=A");  // D = ARG
 	A_instructions(to_string(offset)); // A = offset
-	output_assembler("D=D+A"); // A = ARG + offset
+	output_asm("D=D+A"); // A = ARG + offset
     register_to_A(R13); // A = 
-	output_assembler("M=D"); 
+	output_asm("M=D"); 
     pop_D();
     register_to_A(R13);
-    output_assembler("A=M"); 
-	output_assembler("M=D"); 
+    output_asm("A=M"); 
+	output_asm("M=D"); 
 }
 static void pop_static(int number){
     pop_D();
     A_instructions(get_class_name()+"."+to_string(number));
-    output_assembler("M=D"); 
+    output_asm("M=D"); 
 
 }
+// segment access lowerings weighed by the cost model
+// a small offset is reached by stepping A one word at a time instead of adding it with D
+// the added pop needs no R13, D = address + value so A = D - value and M = D - address
+enum segment_lowering { segment_fixed, segment_added, segment_walk };
+static segment_lowering choose_segment_lowering(bool push,int offset,lowering_cost &cost){
+    lowering_cost fixed = { push ? 10 : 13, push ? 10 : 13 };
+    lowering_cost added = { 9, 9 };
+    lowering_cost walk = { (push ? 7 : 6) + offset, (push ? 7 : 6) + offset };
+    cost_weighting weighting = current_weighting();
+    if (cheaper(weighting,walk,fixed) && !cheaper(weighting,added,walk)){
+        cost = walk;
+        return segment_walk;
+    }
+    if (cheaper(weighting,added,fixed)){
+        cost = added;
+        return segment_added;
+    }
+    cost = fixed;
+    return segment_fixed;
+}
+static void push_segment(register_name rn,int offset){
+    if (cache_fields && (rn == THIS || rn == THAT) && output_cached_field(rn,offset,true)){
+        return;
+    }
+    lowering_cost cost;
+    switch (choose_segment_lowering(true,offset,cost)){
+    case segment_walk:
+        register_to_A(rn);
+        output_asm("A=M");
+        for (int i = 0; i < offset; i++){
+            output_asm("A=A+1");
+        }
+        output_asm("D=M");
+        push_D();
+        break;
+    case segment_added:
+        register_to_A(rn);
+        output_asm("D=M");
+        A_instructions(to_string(offset));
+        output_asm("A=D+A");
+        output_asm("D=M");
+        push_D();
+        break;
+    default:
+        push_address_offset_value(rn,offset);
+        break;
+    }
+}
+static void pop_segment(register_name rn,int offset){
+    if (cache_fields && (rn == THIS || rn == THAT) && output_cached_field(rn,offset,false)){
+        return;
+    }
+    lowering_cost cost;
+    switch (choose_segment_lowering(false,offset,cost)){
+    case segment_walk:
+        pop_D();
+        register_to_A(rn);
+        output_asm("A=M");
+        for (int i = 0; i < offset; i++){
+            output_asm("A=A+1");
+        }
+        output_asm("M=D");
+        break;
+    case segment_added:
+        register_to_A(rn);
+        output_asm("D=M");
+        A_instructions(to_string(offset));
+        output_asm("D=D+A");
+        register_to_A(SP);
+        output_asm("AM=M-1");
+        output_asm("D=D+M");
+        output_asm("A=D-M");
+        output_asm("M=D-A");
+        break;
+    default:
+        pop_address_offset_value(rn,offset);
+        break;
+    }
+}
+// field address caching
+// the cost of reaching field offset of the cached base from R15, the cache is only used when that is cheaper
+static bool use_cached_field(register_name rn,int offset,bool push){
+    if (cached_base != rn){
+        return false;
+    }
+    int distance = abs(offset - cached_offset);
+    lowering_cost cached = { (push ? 7 : 6) + distance, (push ? 7 : 6) + distance };
+    lowering_cost regular;
+    choose_segment_lowering(push,offset,regular);
+    cost_weighting weighting = current_weighting() == weigh_nothing ? weigh_speed : current_weighting();
+    return cheaper(weighting,cached,regular);
+}
+static bool output_cached_field(register_name rn,int offset,bool push){
+    if (use_cached_field(rn,offset,push)){
+        if (!push){
+            pop_D();
+        }
+        register_to_A(R15);
+        output_asm("A=M");
+        for (int i = cached_offset; i < offset; i++){
+            output_asm("A=A+1");
+        }
+        for (int i = offset; i < cached_offset; i++){
+            output_asm("A=A-1");
+        }
+        if (push){
+            output_asm("D=M");
+            push_D();
+        }else{
+            output_asm("M=D");
+        }
+        return true;
+    }
+    if (!field_cache_wanted){
+        return false;
+    }
+    // R15 = base + offset
+    register_to_A(rn);
+    if (offset == 0){
+        output_asm("D=M");
+    }else if (offset == 1){
+        output_asm("D=M+1");
+    }else{
+        output_asm("D=M");
+        A_instructions(to_string(offset));
+        output_asm("D=D+A");
+    }
+    register_to_A(R15);
+    if (push){
+        output_asm("AM=D");
+        output_asm("D=M");
+        push_D();
+    }else{
+        output_asm("M=D");
+        pop_D();
+        register_to_A(R15);
+        output_asm("A=M");
+        output_asm("M=D");
+    }
+    cached_base = rn;
+    cached_offset = offset;
+    return true;
+}
+// R15 and the bases are only known to be unchanged in straight line code without calls
+static bool field_cache_clobbered(const vm_command &command){
+    switch (command.op){
+    case vm_label: case vm_call: case vm_return: case vm_function:
+        return true;
+    case vm_eq: case vm_gt: case vm_lt:
+        return cheaper(current_weighting(),shared_compare_cost,inline_compare_cost);
+    case vm_pop:
+        return command.segment == vm_pointer;
+    default:
+        return false;
+    }
+}
+// will another access through the same base at commands[i] find the address worth caching
+static bool field_reused(vector<vm_command> &commands,vector<stack_rewrite> &rewrites,size_t i){
+    const vm_command &access = commands[i];
+    if (!vm_is_stack(access.op) || (access.segment != vm_this && access.segment != vm_that)){
+        return false;
+    }
+    register_name rn = access.segment == vm_this ? THIS : THAT;
+    for (size_t j = i + 1; j < commands.size(); j++){
+        if (rewrites[j] != rewrite_none || field_cache_clobbered(commands[j])){
+            return false;
+        }
+        if (vm_is_stack(commands[j].op) && commands[j].segment == access.segment){
+            int saved_base = cached_base;
+            int saved_offset = cached_offset;
+            cached_base = rn;
+            cached_offset = access.number;
+            bool reused = use_cached_field(rn,commands[j].number,commands[j].op == vm_push);
+            cached_base = saved_base;
+            cached_offset = saved_offset;
+            return reused;
+        }
+    }
+    return false;
+}
+// 0 and 1 can be stored without D
+static void push_constant_lowered(int number){
+    lowering_cost fixed = { 6, 6 };
+    lowering_cost stored = { 4, 4 };
+    if (number <= 1 && cheaper(current_weighting(),stored,fixed)){
+        register_to_A(SP);
+        output_asm("AM=M+1");
+        output_asm("A=A-1");
+        output_asm(number == 0 ? "M=0" : "M=1");
+    }else{
+        push_constant(number);
+    }
+}
+static void push_static_lowered(int number){
+    lowering_cost fixed = { 7, 7 };
+    lowering_cost direct = { 6, 6 };
+    if (cheaper(current_weighting(),direct,fixed)){
+        A_instructions(get_class_name()+"."+to_string(number));
+        output_asm("D=M");
+        push_D();
+    }else{
+        push_static(number);
+    }
+}
 static void pop_D(){
     register_to_A(SP);
-	output_assembler("AM=M-1"); 
-	output_assembler("D=M"); 
+	output_asm("AM=M-1"); 
+	output_asm("D=M"); 
 }
 
 static void pop_A(){
     pop_D();
-    output_assembler("A=D");
+    output_asm("A=D");
 }
 
 static void pop_register(register_name rn){
     pop_D();
     A_instructions("R"+to_string(rn)); 
-	output_assembler("M=D"); 
+	output_asm("M=D"); 
+}
+// instruction templates
+// the fixed translation of each command / segment pair written out in full, # marks the operand
+// with --asm a command is emitted by copying its template and patching in the operand,
+// the checked output system is still given one instruction at a time
+// the operator and stack templates repeat their helpers' instructions, check_templates() keeps the two in step
+struct instruction_template
+{
+    const char *text;
+    int instructions;
+};
+static constexpr int template_lines(const char *text){
+    return *text == '\0' ? 0 : (*text == '\n') + template_lines(text + 1);
+}
+#define TEMPLATE(text) { text, template_lines(text) }
+#define PUSH_D "@R0\nAM=M+1\nA=A-1\nM=D\n"
+#define POP_D "@R0\nAM=M-1\nD=M\n"
+#define TWO_OPERANDS "@R0\nAM=M-1\nD=M\nA=A-1\n"
+#define PUSH_SEGMENT(rn) TEMPLATE("@" rn "\nA=M\nD=A\n@#\nA=D+A\nD=M\n" PUSH_D)
+#define POP_SEGMENT(rn) TEMPLATE("@" rn "\nA=M\nD=A\n@#\nD=D+A\n@R13\nM=D\n" POP_D "@R13\nA=M\nM=D\n")
+// indexed by vm_segment, the operand of temp and pointer is the register number, of static the variable name
+static constexpr instruction_template push_templates[] =
+{
+    PUSH_SEGMENT("R2"),                             // argument
+    TEMPLATE("@#\nD=A\n" PUSH_D),                 // constant
+    PUSH_SEGMENT("R1"),                             // local
+    TEMPLATE("@R#\nD=M\n" PUSH_D),                // pointer
+    TEMPLATE("@#\nA=M\nD=A\n" PUSH_D),           // static
+    TEMPLATE("@R#\nD=M\n" PUSH_D),                // temp
+    PUSH_SEGMENT("R4"),                             // that
+    PUSH_SEGMENT("R3"),                             // this
+};
+static constexpr instruction_template pop_templates[] =
+{
+    POP_SEGMENT("R2"),                              // argument
+    TEMPLATE(""),                                   // constant
+    POP_SEGMENT("R1"),                              // local
+    TEMPLATE(POP_D "@R#\nM=D\n"),                 // pointer
+    TEMPLATE(POP_D "@#\nM=D\n"),                  // static
+    TEMPLATE(POP_D "@R#\nM=D\n"),                 // temp
+    POP_SEGMENT("R4"),                              // that
+    POP_SEGMENT("R3"),                              // this
+};
+// indexed by vm_opcode up to vm_label, commands without a template have no text
+static constexpr instruction_template command_templates[] =
+{
+    TEMPLATE(TWO_OPERANDS "M=D+M\n"),              // add
+    TEMPLATE(TWO_OPERANDS "M=D&M\n"),              // and
+    { 0, 0 },                                       // eq
+    { 0, 0 },                                       // gt
+    { 0, 0 },                                       // lt
+    TEMPLATE("@R0\nA=M-1\nM=-M\n"),               // neg
+    TEMPLATE("@R0\nA=M-1\nM=!M\n"),               // not
+    TEMPLATE(TWO_OPERANDS "M=D|M\n"),              // or
+    TEMPLATE(TWO_OPERANDS "M=M-D\n"),              // sub
+    { 0, 0 },                                       // return
+    TEMPLATE("@#\n0;JMP\n"),                      // goto
+    TEMPLATE(POP_D "@#\nD;JNE\n"),                // if-goto
+    { 0, 0 },                                       // label
+};
+#undef POP_SEGMENT
+#undef PUSH_SEGMENT
+#undef TWO_OPERANDS
+#undef POP_D
+#undef PUSH_D
+#undef TEMPLATE
+
+// the template for a command, 0 if it has none or the cost model may choose another translation
+static const instruction_template *find_template(const vm_command &command){
+    if (vm_is_jump(command.op)){
+        return command_templates[command.op].text != 0 ? &command_templates[command.op] : 0;
+    }
+    if (current_weighting() != weigh_nothing){
+        return 0;
+    }
+    if (vm_is_operator(command.op)){
+        return command_templates[command.op].text != 0 ? &command_templates[command.op] : 0;
+    }
+    if (!vm_is_stack(command.op) || command.segment == vm_no_segment ||
+        (command.op == vm_pop && command.segment == vm_constant) ||
+        (cache_fields && (command.segment == vm_this || command.segment == vm_that))){
+        return 0;
+    }
+    return command.op == vm_push ? &push_templates[command.segment] : &pop_templates[command.segment];
+}
+// the operand patched into a stack command's template
+static string template_operand(const vm_command &command){
+    switch (command.segment){
+    case vm_static:     return get_class_name() + "." + to_string(command.number);
+    case vm_temp:       return to_string(5 + command.number);
+    case vm_pointer:    return to_string(3 + command.number);
+    default:            return to_string(command.number);
+    }
+}
+// the template text with its operand patched in
+static string template_text(const instruction_template *tpl,const string &operand){
+    const char *text = tpl->text;
+    string out;
+    out.reserve(strlen(text) + operand.size() * 2);
+    for (const char *hash; (hash = strchr(text,'#')) != 0; text = hash + 1){
+        out.append(text,hash - text);
+        out += operand;
+    }
+    out += text;
+    return out;
+}
+static void output_template(const instruction_template *tpl,const string &operand){
+    const char *text = tpl->text;
+    if (!assembly_output){
+        string instruction;
+        for (; *text != '\0'; text++){
+            if (*text == '\n'){
+                output_asm(instruction);
+                instruction.clear();
+            }else if (*text == '#'){
+                instruction += operand;
+            }else{
+                instruction += *text;
+            }
+        }
+        return;
+    }
+    write_to_output(template_text(tpl,operand));
+    rom_address += tpl->instructions;
 }
 // function 
 static void output_function(string label,int number){
-    output_assembler("// function "+label+" "+to_string(number)) ;
+    output_asm("// function "+label+" "+to_string(number)) ;
+    vm_labels_end_function(assembly_output);
+    vm_labels_start_function(label);
     set_class_and_function_name(label);
     output_label (label);
-    for (int i = 1; i <= number; i++){
-        push_0();
+    in_register_leaf = register_leaf(label);
+    current_frame = function_frame(label);
+    if (source_map_file != "" && (in_register_leaf || current_frame != FULL_FRAME)){
+        source_map += "# frame " + label + " " + to_string(in_register_leaf ? 0 : frame_size(current_frame)) + " " +
+                      to_string(vm_program_function(label)->arguments) + "\n";
+    }
+    if (in_register_leaf){
+        leaf_entry(label,number);
+        return;
+    }
+    if (instrument_functions){
+        output_counter(label);
+    }
+    output_prologue(number);
+    if (shared_returns == return_per_function){
+        shared_return_label[current_frame] = "";
+    }
+}
+// zero number locals
+static void output_prologue(int number){
+    vector<int> zeros;
+    for (int i = 0; i < number; i++){
+        if (i >= (int)locals_written_first.size() || !locals_written_first[i]){
+            zeros.push_back(i);
+        }
+    }
+    // the bulk and unrolled forms have no loops so cycles = instructions
+    int bulk_size = (zeros.empty() ? 0 : 2 + zeros.back() + zeros.size()) + (number <= 2 ? 1 + number : 4);
+    lowering_cost unrolled = { 5 * number, 5 * number };
+    lowering_cost bulk = { bulk_size, bulk_size };
+    lowering_cost loop = { 9, 2 + 7 * number };
+    bool loop_allowed = assembly_output || loop.cycles <= PROLOGUE_CHECKED_CYCLES;
+
+    cost_weighting weighting = prologue;
+    if (weighting != weigh_nothing && current_weighting() == weigh_size){
+        weighting = weigh_size;
+    }
+    if (number == 0 || weighting == weigh_nothing ||
+        (!cheaper(weighting,bulk,unrolled) && !(loop_allowed && cheaper(weighting,loop,unrolled)))){
+        for (int i = 1; i <= number; i++){
+            push_0();
+        }
+    }else if (!loop_allowed || !cheaper(weighting,loop,bulk)){
+        if (!zeros.empty()){
+            register_to_A(SP);
+            output_asm("A=M");
+            int at = 0;
+            for (size_t i = 0; i < zeros.size(); i++){
+                for (; at < zeros[i]; at++){
+                    output_asm("A=A+1");
+                }
+                output_asm("M=0");
+            }
+        }
+        if (number <= 2){
+            register_to_A(SP);
+            for (int i = 0; i < number; i++){
+                output_asm("M=M+1");
+            }
+        }else{
+            A_instructions(to_string(number));
+            output_asm("D=A");
+            register_to_A(SP);
+            output_asm("M=D+M");
+        }
+    }else{
+        string loop = get_temp_label();
+        A_instructions(to_string(number));
+        output_asm("D=A");
+        add_temp_label();
+        updata_counter();
+        register_to_A(SP);
+        output_asm("AM=M+1");
+        output_asm("A=A-1");
+        output_asm("M=0");
+        output_asm("D=D-1");
+        A_instructions(loop);
+        output_asm("D;JGT");
+    }
+    locals_written_first.clear();
+}
+// scan the first basic block of the function at commands[function] for locals popped before they are pushed
+// calls do not end the block, a callee cannot read the caller's locals
+static void find_locals_written_first(vector<vm_command> &commands,size_t function){
+    int number = commands[function].number;
+    locals_written_first.assign(number,false);
+    vector<bool> read(number,false);
+    for (size_t i = function + 1; i < commands.size(); i++){
+        const vm_command &command = commands[i];
+        if (vm_is_jump(command.op) || command.op == vm_return || command.op == vm_function){
+            break;
+        }
+        if (command.op == vm_push && command.segment == vm_local && command.number < number){
+            read[command.number] = true;
+        }
+        if (command.op == vm_pop && command.segment == vm_local && command.number < number && !read[command.number]){
+            locals_written_first[command.number] = true;
+        }
     }
 }
+// return, share one epilogue per class if that is cheaper
+static void output_return(){
+    if (in_register_leaf){
+        leaf_return();
+        return;
+    }
+    return_sharing sharing = shared_returns;
+    lowering_cost shared_cost = frame_cost(shared_return_cost,current_frame,0,7);
+    if (sharing == return_inline && cheaper(current_weighting(),shared_cost,frame_cost(inline_return_cost,current_frame,7,7))){
+        sharing = return_per_class;
+    }
+    if (sharing == return_inline){
+        op_return();
+        return;
+    }
+    string &label = shared_return_label[current_frame];
+    if (label != ""){
+        jmp_label(label);
+        return;
+    }
+    if (sharing == return_per_function){
+        label = get_class_name() + "." + function_name + "..return";
+    }else{
+        label = get_class_name() + "..return" + frame_suffix(current_frame);
+    }
+    output_label(label);
+    op_return();
+}
 
 static void output_call(string label,int number){
-    output_assembler("// call " + label + " " + to_string(number)) ;
+    output_asm("// call " + label + " " + to_string(number)) ;
+    if (instrument_functions){
+        output_counter(get_class_name() + "." + function_name + ">" + label);
+    }
+    if (use_intrinsics && output_intrinsic(label,number)){
+        return;
+    }
+    if (register_leaf(label)){
+        leaf_call(label,number);
+        return;
+    }
+    int frame = function_frame(label);
+    if (cheaper(current_weighting(),frame_cost(shared_call_cost,frame,0,6),frame_cost(inline_call_cost,frame,6,6))){
+        A_instructions(to_string(number));
+        output_asm("D=A");
+        register_to_A(R14);
+        output_asm("M=D");
+        A_instructions(label);
+        output_asm("D=A");
+        register_to_A(R13);
+        output_asm("M=D");
+        A_instructions(get_temp_label());
+        output_asm("D=A");
+        jmp_label(shared_call_label(frame));
+        add_temp_label();
+        updata_counter();
+        shared_call_used[frame] = true;
+        return;
+    }
+    inline_call(label,number);
+}
+// the full call sequence, the frame saves what the callee changes
+static void inline_call(string label,int number){
+    int frame = function_frame(label);
     // push
     A_instructions(get_temp_label());
     push_A();
     push_register(LCL);
     push_register(ARG);
-    push_register(THIS);
-    push_register(THAT);
+    if (frame & 1){
+        push_register(THIS);
+    }
+    if (frame & 2){
+        push_register(THAT);
+    }
 
     // updata register
-    // ARG = SP - n - 5
+    // ARG = SP - n - 5, less for a reduced frame
     register_to_A(SP);
-    output_assembler("D=M");// D = SP
-    A_instructions("5");
-    output_assembler("D=D-A");// D = SP - 5
+    output_asm("D=M");// D = SP
+    A_instructions(to_string(frame_size(frame)));
+    output_asm("D=D-A");// D = SP - 5
     A_instructions(to_string(number));
-    output_assembler("D=D-A");// D = SP - 5 - n
+    output_asm("D=D-A");// D = SP - 5 - n
     register_to_A(ARG);
-    output_assembler("M=D");// M = SP - 5 - n
+    output_asm("M=D");// M = SP - 5 - n
     // LCL = SP
     register_to_A(SP);
-    output_assembler("D=M");// D = SP
+    output_asm("D=M");// D = SP
     register_to_A(LCL);
-    output_assembler("M=D");// LCL = SP
+    output_asm("M=D");// LCL = SP
 
     // jmp label
     jmp_label(label);
@@ -425,221 +1308,1912 @@ static void output_call(string label,int number){
     updata_counter();
 }
 
-/************      END OF HELPER FUNCTIONS       **************/
-
-///////////////////////////////////////////////////////////////
-
-
-
-// the function translate_vm_class() will be called by the main program
-// its is passed the abstract syntax tree constructed by the parser
-// it walks the abstract syntax tree and produces the equivalent VM code as output
-static void translate_vm_class(ast root)
-{
-    // assumes we have a "class" node containing VM command nodes
-    ast_mustbe_kind(root,ast_vm_class) ;
-
-    // tell the output system we are starting to translate VM commands for a Jack class
-    start_of_vm_class() ;
-
-    int ncommands = size_of_vm_class(root) ;
-    for ( int i = 0 ; i < ncommands ; i++ )
-    {
-        translate_vm_command(get_vm_class(root,i)) ;
+// whole program calling convention
+static bool register_leaf(const string &name){
+    const vm_function_summary *function = whole_program ? vm_program_function(name) : 0;
+    return function != 0 && name != "Sys.init" && name != "Main.main" && !function->calls && function->balanced &&
+           function->arguments >= 0 && function->arguments <= LEAF_ARGUMENTS && function->arguments_used <= function->arguments &&
+           function->locals <= LEAF_LOCALS && function->locals_used <= function->locals;
+}
+// the cell holding an argument or local of a leaf, "" if command is not such an access
+static string leaf_cell(const vm_command &command){
+    if (!in_register_leaf || !vm_is_stack(command.op)){
+        return "";
     }
-
-    // tell the output system we have just finished translating VM commands for a Jack class
-    end_of_vm_class() ;
-
+    if (command.segment == vm_argument){
+        return "leaf..arg" + to_string(command.number);
+    }
+    if (command.segment == vm_local){
+        return "leaf..local" + to_string(command.number);
+    }
+    return "";
 }
-
-// translate the current vm command - a bad node is a fatal error
-static void translate_vm_command(ast command)
-{
-    switch(ast_node_kind(command))
-    {
-    case ast_vm_operator:
-        translate_vm_operator(command) ;
-        break ;
-    case ast_vm_jump:
-        translate_vm_jump(command) ;
-        break ;
-    case ast_vm_function:
-        translate_vm_func(command) ;
-        break ;
-    case ast_vm_stack:
-        translate_vm_stack(command) ;
-        break ;
-    default:
-        fatal_error(0,"// bad node - expected vm_operator, vm_jump, vm_function or vm_stack\n") ;
-        break ;
+static void leaf_call(string label,int number){
+    for (int i = number - 1; i >= 0; i--){
+        pop_D();
+        A_instructions("leaf..arg" + to_string(i));
+        output_asm("M=D");
     }
+    A_instructions(get_temp_label());
+    output_asm("D=A");
+    jmp_label(label);
+    add_temp_label();
+    updata_counter();
 }
-
-// translate vm operator command into assembly language
-static void translate_vm_operator(ast vm_op)
-{
-    // extract command specific info from the ast node passed in
-    string the_op = get_vm_operator_command(vm_op) ;
-
-    // tell the output system what kind of VM command we are now trying to implement
-    start_of_vm_operator_command(the_op) ;
-
-    /************   ADD CODE BETWEEN HERE   **************/
-
-    // use the output_assembler() function to implement this VM command in Hack Assembler
-    // careful use of helper functions you can define above will keep your code simple
-    // ...
-    if (the_op == "add"){
-		op_add();
-	}else if (the_op == "return"){
-		op_return();
-	} else if (the_op == "and"){
-		op_and();
-	} else if (the_op == "eq"){
-		op_eq();
-	} else if (the_op == "gt"){
-		op_gt();
-	} else if (the_op == "lt"){
-		op_lt();
-	} else if (the_op == "neg"){
-		op_neg();
-	} else if (the_op == "not"){
-		op_not();
-	} else if (the_op == "or"){
-		op_or();
-	} else{
-		op_sub();
-	} 
-
-    /************         AND HERE          **************/
-
-    // tell the output system that we have just finished trying to implement a VM command
-    end_of_vm_command() ;
+static void leaf_entry(string label,int number){
+    const vm_function_summary *function = vm_program_function(label);
+    A_instructions("leaf..return");
+    output_asm("M=D");
+    if (instrument_functions){
+        output_counter(label);
+    }
+    if (function->pops_this){
+        register_to_A(THIS);
+        output_asm("D=M");
+        A_instructions("leaf..this");
+        output_asm("M=D");
+    }
+    if (function->pops_that){
+        register_to_A(THAT);
+        output_asm("D=M");
+        A_instructions("leaf..that");
+        output_asm("M=D");
+    }
+    for (int i = 0; i < number; i++){
+        if (i >= (int)locals_written_first.size() || !locals_written_first[i]){
+            A_instructions("leaf..local" + to_string(i));
+            output_asm("M=0");
+        }
+    }
+    locals_written_first.clear();
 }
-
-// translate vm operator command into assembly language
-static void translate_vm_jump(ast jump)
-{
-    // extract command specific info from the ast node passed in
-    string command = get_vm_jump_command(jump) ;
-    string label = get_vm_jump_label(jump) ;
-
-    // tell the output system what kind of VM command we are now trying to implement
-    start_of_vm_jump_command(command,label) ;
-
-    /************   ADD CODE BETWEEN HERE   **************/
-
-    // use the output_assembler() function to implement this VM command in Hack Assembler
-    // careful use of helper functions you can define above will keep your code simple
-    // ...
-    if (command == "label"){
-		output_label(get_prefix() + label);
-	}else if (command == "if-goto"){
-		output_if_goto(label);
-	}else{ // goto
-		output_goto(label);
-	}
-
-    /************         AND HERE          **************/
-
-    // tell the output system that we have just finished trying to implement a VM command
-    end_of_vm_command() ;
+// reduced frames
+static int function_frame(const string &name){
+    const vm_function_summary *function = whole_program && level_weighting != weigh_size ? vm_program_function(name) : 0;
+    if (function == 0 || name == "Sys.init" || name == "Main.main" || function->arguments == -1){
+        return FULL_FRAME;
+    }
+    return (function->pops_this ? 1 : 0) | (function->pops_that ? 2 : 0);
 }
-
-// translate vm operator command into assembly language
-static void translate_vm_func(ast func)
-{
-    // extract command specific info from the ast node passed in
-    string command = get_vm_function_command(func) ;
-    string label = get_vm_function_label(func) ;
-    int number = get_vm_function_number(func) ;
-
-    // tell the output system what kind of VM command we are now trying to implement
-    start_of_vm_func_command(command,label,number) ;
-
-    /************   ADD CODE BETWEEN HERE   **************/
-
-    // function ::= 'call' | 'function'
-    output_assembler("// "+command+" " + label +" "+to_string(number)) ; 
-    if (command == "function"){
-        output_function(label,number);
-    }else{ // call 
-        output_call(label,number);
+// the words pushed by a call, the return address, LCL, ARG and the saved pointers
+static int frame_size(int frame){
+    return 3 + (frame & 1) + (frame >> 1);
+}
+// shared routines are labelled per frame, a full frame keeps the plain label
+static string frame_suffix(int frame){
+    static const char *suffixes[] = { ".bare", ".this", ".that", "" };
+    return suffixes[frame];
+}
+// the cost of a full frame's call or return sequence less the instructions and cycles saved per pointer the frame does not save
+static lowering_cost frame_cost(lowering_cost full,int frame,int instructions,int cycles){
+    int unsaved = 5 - frame_size(frame);
+    lowering_cost cost = { full.instructions - instructions * unsaved, full.cycles - cycles * unsaved };
+    return cost;
+}
+static void leaf_return(){
+    const vm_function_summary *function = vm_program_function(get_class_name() + "." + function_name);
+    if (function->pops_this){
+        A_instructions("leaf..this");
+        output_asm("D=M");
+        register_to_A(THIS);
+        output_asm("M=D");
     }
-
-    /************         AND HERE          **************/
-
-    // tell the output system that we have just finished trying to implement a VM command
-    end_of_vm_command() ;
+    if (function->pops_that){
+        A_instructions("leaf..that");
+        output_asm("D=M");
+        register_to_A(THAT);
+        output_asm("M=D");
+    }
+    A_instructions("leaf..return");
+    output_asm("A=M");
+    output_asm("0;JMP");
 }
 
-// translate vm operator command into assembly language
-static void translate_vm_stack(ast stack)
-{
-    // extract command specific info from the ast node passed in
-    string command = get_vm_stack_command(stack) ;
-    string segment = get_vm_stack_segment(stack) ;
-    int number = get_vm_stack_offset(stack) ;
-
-    // tell the output system what kind of VM command we are now trying to implement
-    start_of_vm_stack_command(command,segment,number) ;
-
-    /************   ADD CODE BETWEEN HERE   **************/
-
-    // use the output_assembler() function to implement this VM command in Hack Assembler
-    // careful use of helper functions you can define above will keep your code simple
-    // ...
-    output_assembler("// "+command+" " + segment +" "+to_string(number)) ; 
-
-    if (command == "push"){
-        if (segment == "static"){
-            push_static(number);
-        }else if (segment == "constant"){
-            push_constant(number);
-        }else if (segment == "temp"){
-            push_temp(number);
-        }else if (segment == "pointer"){
-            push_pointer(number);
-        }else if (segment == "local"){
-            push_address_offset_value(LCL, number);
-        }else if (segment == "argument"){
-            push_address_offset_value(ARG, number);     
-        }else if (segment == "that"){
-            push_address_offset_value(THAT, number);
-        }else if (segment == "this"){
-            push_address_offset_value(THIS, number);
+// profile
+static void read_profile(string path){
+    ifstream file(path.c_str());
+    if (!file){
+        fatal_error(-1,"cannot open profile: " + path + "\n");
+    }
+    profile_counts = create_ints();
+    profile_loaded = true;
+    int hottest = 0;
+    string line;
+    while (getline(file,line)){
+        if (line.empty() || line[0] == '#'){
+            continue;
         }
-    }else{ // pop
-        if (segment == "static"){
-            pop_static(number);
-        }else if (segment == "temp"){
-            pop_temp(number);
-        }else if (segment == "pointer"){
-            pop_pointer(number);
-        }else if (segment == "local"){
-            pop_address_offset_value(LCL, number);
-        }else if (segment == "argument"){
-            pop_address_offset_value(ARG, number);     
-        }else if (segment == "that"){
-            pop_address_offset_value(THAT, number);
-        }else if (segment == "this"){
-            pop_address_offset_value(THIS, number);
+        istringstream fields(line);
+        string key;
+        int count;
+        if (!(fields >> key >> count) || count < 0){
+            fatal_error(-1,"bad profile line: " + line + "\n");
+        }
+        update_ints(profile_counts,key,count);
+        if (key.find_first_of("$>") == string::npos && count > hottest){
+            hottest = count;
         }
     }
+    profile_hot_threshold = max(1,hottest / PROFILE_HOT_RATIO);
+}
+static int profile_count(string key){
+    return max(0,lookup_ints(profile_counts,key));
+}
+// shared routines trade a few extra cycles for much less code so they are only used in cold functions
+static bool use_shared_routines(){
+    return profile_loaded && profile_count(class_name + "." + function_name) < profile_hot_threshold;
+}
 
-    /************         AND HERE          **************/
+// cost model
+static cost_weighting current_weighting(){
+    return use_shared_routines() ? weigh_size : level_weighting;
+}
+// true if a is strictly cheaper than b, nothing is cheaper when nothing is weighed
+static bool cheaper(cost_weighting weighting,lowering_cost a,lowering_cost b){
+    switch (weighting){
+    case weigh_speed:
+        return a.cycles < b.cycles || (a.cycles == b.cycles && a.instructions < b.instructions);
+    case weigh_size:
+        return a.instructions < b.instructions || (a.instructions == b.instructions && a.cycles < b.cycles);
+    default:
+        return false;
+    }
+}
 
-    // tell the output system that we have just finished trying to implement a VM command
-    end_of_vm_command() ;
+// block layout
+// Jack compiles if statements to: if-goto T ; goto F ; label T ; ... ; [goto E ;] label F ; ...
+// if the profile says T is reached less often than F, the T block is moved to the end of the function
+// so that the hot F block follows the if-goto and the goto F disappears from the hot path
+static int find_label(vector<vm_command> &commands,int from,int to,string label){
+    for (int i = from; i < to; i++){
+        if (commands[i].op == vm_label && commands[i].label == label){
+            return i;
+        }
+    }
+    return -1;
+}
+static bool unconditional(const vm_command &command){
+    return command.op == vm_goto || command.op == vm_return;
+}
+static void layout_cold_branches(vector<vm_command> &commands){
+    int start = 0;
+    while (start < (int)commands.size()){
+        // the commands of one function are [start,end)
+        int end = start + 1;
+        while (end < (int)commands.size() && commands[end].op != vm_function){
+            end++;
+        }
+        string prefix = commands[start].label + "$";
+
+        for (int i = start; i + 2 < end; i++){
+            if (commands[i].op != vm_if_goto || commands[i + 1].op != vm_goto ||
+                commands[i + 2].op != vm_label || commands[i + 2].label != commands[i].label){
+                continue;
+            }
+            int f = find_label(commands,i + 3,end,commands[i + 1].label);
+            if (f < 0 || !unconditional(commands[end - 1])){
+                continue;
+            }
+            if (profile_count(prefix + commands[i].label) >= profile_count(prefix + commands[i + 1].label)){
+                continue;
+            }
+            // move [i+2,f) to the end of the function, an if without an else must then jump back to F
+            vector<vm_command> cold(commands.begin() + i + 2,commands.begin() + f);
+            if (!unconditional(cold.back())){
+                cold.push_back(commands[i + 1]);
+            }
+            commands.erase(commands.begin() + i + 2,commands.begin() + f);
+            commands.insert(commands.begin() + end - (f - i - 2),cold.begin(),cold.end());
+            end += cold.size() - (f - i - 2);
+            // drop the goto F
+            commands.erase(commands.begin() + i + 1);
+            end--;
+        }
+        start = end;
+    }
 }
 
-// main program
-int main(int argc,char **argv)
-{
-    // parse abstract syntax tree and pass to the translator
-    translate_vm_class(ast_parse_xml()) ;
+// loop invariant hoisting
+// a loop is label L ... goto L that nothing outside it jumps into, a Jack while statement compiles to:
+//   label WHILE_EXPn ; <condition> ; not ; if-goto WHILE_ENDn ; <body> ; goto WHILE_EXPn ; label WHILE_ENDn
+// loads that nothing in the loop can change are made once before label L and kept in an extra local,
+// but only if the cost model makes pushing it cheaper than the original load,
+// temp is not used because it is shared with the callers and callees, who may read it
+// this is a VM to VM rewrite so it works with the checked output too
+static vm_command make_command(vm_opcode op,vm_segment segment,int number){
+    vm_command command;
+    command.op = op;
+    command.segment = segment;
+    command.number = number;
+    command.index = -1;
+    return command;
+}
+// instructions to push the value of a load, load is one command or push constant c followed by neg or not
+static int load_cost(const vm_command &push,bool pair){
+    int cost = 6;
+    bool weighed = level_weighting != weigh_nothing;
+    switch (push.segment){
+    case vm_local: case vm_argument: case vm_this: case vm_that:
+        cost = weighed ? min(9,7 + push.number) : 10;
+        break;
+    case vm_static:
+        cost = weighed ? 6 : 7;
+        break;
+    case vm_constant:
+        cost = weighed && push.number <= 1 ? 4 : 6;
+        break;
+    default:
+        break;
+    }
+    return pair ? cost + 3 : cost;
+}
+static bool is_constant_pair(vector<vm_command> &commands,int i,int end){
+    return commands[i].op == vm_push && commands[i].segment == vm_constant && i + 1 < end &&
+           (commands[i + 1].op == vm_neg || commands[i + 1].op == vm_not);
+}
+static bool same_load(vector<vm_command> &commands,int i,int j,int end){
+    if (commands[i].op != commands[j].op || !same_location(commands[i],commands[j])) return false;
+    bool pair = is_constant_pair(commands,i,end);
+    if (pair != is_constant_pair(commands,j,end)) return false;
+    return !pair || commands[i + 1].op == commands[j + 1].op;
+}
+// is the load at commands[i] unchanged by every command in [first,last]
+static bool invariant_load(vector<vm_command> &commands,int i,int first,int last,int end){
+    const vm_command &load = commands[i];
+    if (load.op != vm_push) return false;
+    if (load.segment == vm_constant) return is_constant_pair(commands,i,end);
+    if (load.segment == vm_temp || load.segment == vm_pointer) return false;
+    for (int j = first; j <= last; j++){
+        const vm_command &command = commands[j];
+        if (command.op == vm_call && (load.segment == vm_this || load.segment == vm_that || load.segment == vm_static)){
+            return false;
+        }
+        if (command.op != vm_pop) continue;
+        if (same_location(command,load)) return false;
+        if (command.segment == vm_pointer && command.number == (load.segment == vm_this ? 0 : 1) &&
+            (load.segment == vm_this || load.segment == vm_that)){
+            return false;
+        }
+        // this and that may point into the same object
+        if ((load.segment == vm_this && command.segment == vm_that) || (load.segment == vm_that && command.segment == vm_this)){
+            return false;
+        }
+    }
+    return true;
+}
+// the loop starting at label commands[l] of the function [start,end), -1 if it is not a loop
+static int loop_end(vector<vm_command> &commands,int l,int start,int end){
+    int g = -1;
+    for (int i = l + 1; i < end; i++){
+        if (commands[i].op == vm_goto && commands[i].label == commands[l].label){
+            g = i;
+        }
+    }
+    if (g < 0) return -1;
+    // nothing outside [l,g] may jump to a label in [l,g]
+    for (int i = start; i < end; i++){
+        if ((i >= l && i <= g) || (commands[i].op != vm_goto && commands[i].op != vm_if_goto)) continue;
+        int target = find_label(commands,start,end,commands[i].label);
+        if (target < 0 || (target >= l && target <= g)) return -1;
+    }
+    return g;
+}
+static void hoist_loop_invariants(vector<vm_command> &commands){
+    int start = 0;
+    while (start < (int)commands.size()){
+        int end = start + 1;
+        while (end < (int)commands.size() && commands[end].op != vm_function){
+            end++;
+        }
+        // outer loops first so a load is hoisted as far as possible, indexes move as commands are inserted
+        for (int l = start; l < end; l++){
+            if (commands[l].op != vm_label) continue;
+            int g = loop_end(commands,l,start,end);
+            if (g < 0) continue;
+            for (int i = l; i <= g; i++){
+                if (!invariant_load(commands,i,l,g,end)) continue;
+                bool pair = is_constant_pair(commands,i,end);
+                vm_command slot = make_command(vm_push,vm_local,commands[start].number);
+                if (load_cost(slot,false) >= load_cost(commands[i],pair)) continue;
+                commands[start].number++;
+
+                // replace every copy of the load in the loop with a push of the slot
+                vm_command load = commands[i];
+                vm_command unary = pair ? commands[i + 1] : load;
+                for (int j = g; j >= l; j--){
+                    if (!same_load(commands,j,i,end) || j == i) continue;
+                    commands[j].segment = slot.segment;
+                    commands[j].number = slot.number;
+                    if (pair){
+                        commands.erase(commands.begin() + j + 1);
+                        g--;
+                        end--;
+                    }
+                }
+                commands[i].segment = slot.segment;
+                commands[i].number = slot.number;
+                if (pair){
+                    commands.erase(commands.begin() + i + 1);
+                    g--;
+                    end--;
+                }
+
+                // the preheader computes the value once before label L
+                vector<vm_command> preheader(1,load);
+                if (pair) preheader.push_back(unary);
+                preheader.push_back(make_command(vm_pop,slot.segment,slot.number));
+                commands.insert(commands.begin() + l,preheader.begin(),preheader.end());
+                l += preheader.size();
+                i += preheader.size();
+                g += preheader.size();
+                end += preheader.size();
+            }
+        }
+        start = end;
+    }
+}
+
+// shared routines
+// call: R13 = function, R14 = number of arguments, D = return address
+// compare and multiply: R15 = return address
+static string shared_call_label(int frame){
+    return get_class_name() + "..call" + frame_suffix(frame);
+}
+static string shared_compare_label(CompareToken ct){
+    static const char *names[] = { "lt", "gt", "eq" };
+    return get_class_name() + ".." + names[ct - LT];
+}
+// R15 = return address then jump to routine
+static void call_shared_routine(string routine){
+    A_instructions(get_temp_label());
+    output_asm("D=A");
+    register_to_A(R15);
+    output_asm("M=D");
+    jmp_label(routine);
+    add_temp_label();
+    updata_counter();
+}
+static void output_shared_routines(){
+    for (int frame = FULL_FRAME; frame >= 0; frame--){
+        if (!shared_call_used[frame]){
+            continue;
+        }
+        int start = rom_address;
+        output_asm("// shared call");
+        output_label(shared_call_label(frame));
+        push_D();
+        push_register(LCL);
+        push_register(ARG);
+        if (frame & 1){
+            push_register(THIS);
+        }
+        if (frame & 2){
+            push_register(THAT);
+        }
+        // ARG = SP - 5 - n, less for a reduced frame
+        register_to_A(SP);
+        output_asm("D=M");
+        A_instructions(to_string(frame_size(frame)));
+        output_asm("D=D-A");
+        register_to_A(R14);
+        output_asm("D=D-M");
+        register_to_A(ARG);
+        output_asm("M=D");
+        // LCL = SP
+        register_to_A(SP);
+        output_asm("D=M");
+        register_to_A(LCL);
+        output_asm("M=D");
+        jmp_register(R13);
+        shared_routine_region(start,"shared call" + frame_suffix(frame));
+    }
+    static const char *jumps[] = { "D;JLT", "D;JGT", "D;JEQ" };
+    for (int i = 0; i < 3; i++){
+        if (!shared_compare_used[i]){
+            continue;
+        }
+        string routine = shared_compare_label((CompareToken)(LT + i));
+        int start = rom_address;
+        output_asm("// shared compare");
+        output_label(routine);
+        two_operands();
+        output_asm("D=M-D");
+        A_instructions(routine + ".true");
+        output_asm(jumps[i]);
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("M=0");
+        jmp_register(R15);
+        output_label(routine + ".true");
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("M=-1");
+        jmp_register(R15);
+        shared_routine_region(start,"shared " + routine.substr(routine.size() - 2));
+    }
+    if (shared_multiply_used){
+        // shift and add, the product is correct modulo 2^16 just like Math.multiply
+        // R13 = y, R14 = bit mask, RAM[SP] = x shifted left, *(SP - 1) = sum
+        string routine = get_class_name() + "..multiply";
+        int start = rom_address;
+        output_asm("// shared multiply");
+        output_label(routine);
+        pop_D();
+        register_to_A(R13);
+        output_asm("M=D");
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("D=M");
+        output_asm("M=0");
+        output_asm("A=A+1");
+        output_asm("M=D");
+        register_to_A(R14);
+        output_asm("M=1");
+        output_label(routine + ".loop");
+        register_to_A(R14);
+        output_asm("D=M");
+        register_to_A(R13);
+        output_asm("D=D&M");
+        A_instructions(routine + ".skip");
+        output_asm("D;JEQ");
+        register_to_A(SP);
+        output_asm("A=M");
+        output_asm("D=M");
+        output_asm("A=A-1");
+        output_asm("M=D+M");
+        output_label(routine + ".skip");
+        register_to_A(SP);
+        output_asm("A=M");
+        output_asm("D=M");
+        output_asm("M=D+M");
+        register_to_A(R14);
+        output_asm("D=M");
+        output_asm("MD=D+M");
+        A_instructions(routine + ".loop");
+        output_asm("D;JNE");
+        jmp_register(R15);
+        shared_routine_region(start,"shared multiply");
+    }
+    if (shared_append_used){
+        // D = character, *(SP - 1) = string, R15 = address of the table entry being consumed
+        // the return address is kept on the stack under the string while String.appendChar runs
+        string routine = get_class_name() + "..append";
+        int start = rom_address;
+        output_asm("// shared append");
+        output_label(routine);
+        register_to_A(R13);
+        output_asm("M=D");
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("D=M");
+        register_to_A(R14);
+        output_asm("M=D");
+        register_to_A(R15);
+        output_asm("D=M");
+        A_instructions(to_string(STRING_TABLE_ENTRY_SIZE));
+        output_asm("D=D+A");
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("M=D");
+        push_register(R14);
+        push_register(R13);
+        if (register_leaf("String.appendChar")){
+            leaf_call("String.appendChar",2);
+        }else{
+            inline_call("String.appendChar",2);
+        }
+        // swap the string and the address of the next entry then continue from there
+        pop_D();
+        register_to_A(R13);
+        output_asm("M=D");
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("D=M");
+        register_to_A(R14);
+        output_asm("M=D");
+        register_to_A(R15);
+        output_asm("M=D");
+        register_to_A(R13);
+        output_asm("D=M");
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("M=D");
+        jmp_register(R14);
+        shared_routine_region(start,"shared append");
+    }
+}
+
+// string tables
+// the number of push constant c ; call String.appendChar 2 pairs starting at commands[i]
+// if they follow a call String.new 1 and there are enough of them to be worth a table, otherwise 0
+static int string_table_length(vector<vm_command> &commands,size_t i){
+    if (i == 0 || commands[i - 1].op != vm_call || commands[i - 1].label != "String.new" || commands[i - 1].number != 1){
+        return 0;
+    }
+    int pairs = 0;
+    while (i + 1 < commands.size() &&
+           commands[i].op == vm_push && commands[i].segment == vm_constant &&
+           commands[i + 1].op == vm_call && commands[i + 1].label == "String.appendChar" && commands[i + 1].number == 2){
+        pairs++;
+        i += 2;
+    }
+    return pairs < STRING_TABLE_MINIMUM ? 0 : pairs;
+}
+// R15 = address of the first entry
+static void output_string_table_start(){
+    A_instructions(get_temp_label());
+    output_asm("D=A");
+    register_to_A(R15);
+    output_asm("M=D");
+    add_temp_label();
+    updata_counter();
+}
+// every entry is STRING_TABLE_ENTRY_SIZE instructions, the shared routine returns to the next one
+static void output_string_table_entry(int character){
+    A_instructions(to_string(character));
+    output_asm("D=A");
+    jmp_label(get_class_name() + "..append");
+    shared_append_used = true;
+}
+
+// copy propagation and dead temp stores
+// the temp slots live at each command are found by a backwards dataflow pass over each function
+// temp is shared RAM that a callee may read or leave untouched and a caller may read after a return
+// so every temp slot is live before a call and at a return
+static int temp_bit(const vm_command &command){
+    if (command.segment != vm_temp || command.number < 0 || command.number > 7){
+        return 0;
+    }
+    return 1 << command.number;
+}
+static void find_live_temps(vector<vm_command> &commands,size_t start,size_t end,vector<int> &live_out){
+    symbols labels = create_ints();
+    for (size_t i = start; i < end; i++){
+        if (commands[i].op == vm_label){
+            insert_ints(labels,commands[i].label,i);
+        }
+    }
+    vector<int> live_in(end - start,0);
+    bool changed = true;
+    while (changed){
+        changed = false;
+        for (size_t i = end; i-- > start; ){
+            const vm_command &command = commands[i];
+            int out = 0;
+            if (command.op == vm_return){
+                out = 0xff;
+            }else if (command.op != vm_goto && i + 1 < end){
+                out |= live_in[i + 1 - start];
+            }
+            if (command.op == vm_goto || command.op == vm_if_goto){
+                int target = lookup_ints(labels,command.label);
+                out |= target < 0 ? 0xff : live_in[target - start];
+            }
+            int in = out;
+            if (command.op == vm_push){
+                in |= temp_bit(command);
+            }else if (command.op == vm_pop){
+                in &= ~temp_bit(command);
+            }else if (command.op == vm_call){
+                in = 0xff;
+            }
+            if (in != live_in[i - start] || out != live_out[i]){
+                live_in[i - start] = in;
+                live_out[i] = out;
+                changed = true;
+            }
+        }
+    }
+    delete_ints(labels);
+}
+static bool same_location(const vm_command &a,const vm_command &b){
+    return a.segment == b.segment && a.number == b.number;
+}
+// pick a rewrite for every command of the class
+static void find_stack_rewrites(vector<vm_command> &commands,vector<stack_rewrite> &rewrites){
+    size_t n = commands.size();
+    rewrites.assign(n,rewrite_none);
+    vector<int> live_out(n,0xff);
+    for (size_t start = 0; start < n; ){
+        size_t end = start + 1;
+        while (end < n && commands[end].op != vm_function){
+            end++;
+        }
+        find_live_temps(commands,start,end,live_out);
+        start = end;
+    }
+    for (size_t i = 0; i < n; i++){
+        const vm_command &command = commands[i];
+        if (command.op != vm_pop){
+            continue;
+        }
+        int bit = temp_bit(command);
+        if (bit != 0 && i + 3 < n &&
+            commands[i + 1].op == vm_pop && commands[i + 1].segment == vm_pointer && commands[i + 1].number == 1 &&
+            commands[i + 2].op == vm_push && same_location(commands[i + 2],command) &&
+            commands[i + 3].op == vm_pop && commands[i + 3].segment == vm_that && commands[i + 3].number == 0){
+            rewrites[i] = rewrite_array_store;
+            rewrites[i + 1] = rewrites[i + 2] = rewrites[i + 3] = rewrite_skip;
+            i += 3;
+        }else if (i + 1 < n && commands[i + 1].op == vm_push && same_location(commands[i + 1],command)){
+            rewrites[i] = bit != 0 && (live_out[i + 1] & bit) == 0 ? rewrite_drop : rewrite_copy;
+            rewrites[i + 1] = rewrite_skip;
+            i++;
+        }else if (bit != 0 && (live_out[i] & bit) == 0){
+            rewrites[i] = rewrite_discard;
+        }
+    }
+}
+// *(SP - 1) is copied to the location popped by command
+static void output_copy_top(const vm_command &command){
+    register_name base = command.segment == vm_local ? LCL : command.segment == vm_argument ? ARG :
+                         command.segment == vm_this ? THIS : THAT;
+    string cell = leaf_cell(command);
+    if (command.segment == vm_temp || command.segment == vm_pointer || command.segment == vm_static || cell != ""){
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("D=M");
+        if (command.segment == vm_static){
+            A_instructions(get_class_name()+"."+to_string(command.number));
+        }else if (cell != ""){
+            A_instructions(cell);
+        }else{
+            register_to_A((command.segment == vm_temp ? R5 : THIS) + command.number);
+        }
+        output_asm("M=D");
+    }else if (command.number <= 6){
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("D=M");
+        register_to_A(base);
+        output_asm("A=M");
+        for (int i = 0; i < command.number; i++){
+            output_asm("A=A+1");
+        }
+        output_asm("M=D");
+    }else{
+        register_to_A(base);
+        output_asm("D=M");
+        A_instructions(to_string(command.number));
+        output_asm("D=D+A");
+        register_to_A(R13);
+        output_asm("M=D");
+        register_to_A(SP);
+        output_asm("A=M-1");
+        output_asm("D=M");
+        register_to_A(R13);
+        output_asm("A=M");
+        output_asm("M=D");
+    }
+}
+// the output for the first command of a rewrite, later commands of the rewrite emit nothing
+static void output_stack_rewrite(const vm_command &command,stack_rewrite rewrite){
+    output_asm("// " + vm_command_to_string(command));
+    switch (rewrite){
+    case rewrite_copy:
+        output_copy_top(command);
+        break;
+    case rewrite_discard:
+        register_to_A(SP);
+        output_asm("M=M-1");
+        break;
+    case rewrite_array_store:
+        // temp k = value, THAT = address, *THAT = temp k
+        pop_register(R5 + command.number);
+        pop_register(THAT);
+        register_to_A(R5 + command.number);
+        output_asm("D=M");
+        register_to_A(THAT);
+        output_asm("A=M");
+        output_asm("M=D");
+        break;
+    case rewrite_jump_table:
+        output_jump_table(jump_tables[next_jump_table++]);
+        break;
+    default:
+        break;
+    }
+}
+
+// jump tables
+// Jack compiles if (x = c1) {...} else { if (x = c2) {...} else ... } to a chain of tests:
+//   push x ; push constant c1 ; eq ; if-goto T1 ; goto F1 ; label T1 ; ... ; goto E1 ; label F1 ; push x ; push constant c2 ; eq ; ...
+// a later test is only reached through its goto F so nothing runs between two tests and x cannot change,
+// with a profile the goto F may have been dropped and the F block falls through from the if-goto instead
+// the first push x is translated as usual, its if-goto becomes the dispatch and the other tests emit nothing
+// the test starting at commands[i], true if it is push x ; push constant c ; eq ; if-goto T or push constant c ; push x ; eq ; if-goto T
+static bool constant_test(vector<vm_command> &commands,size_t i,size_t end,vm_command &location,int &constant){
+    if (i + 3 >= end || commands[i].op != vm_push || commands[i + 1].op != vm_push ||
+        commands[i + 2].op != vm_eq || commands[i + 3].op != vm_if_goto){
+        return false;
+    }
+    bool first = commands[i].segment == vm_constant;
+    const vm_command &value = commands[first ? i + 1 : i];
+    if (value.segment == vm_constant || (!first && commands[i + 1].segment != vm_constant)){
+        return false;
+    }
+    location = value;
+    constant = commands[first ? i : i + 1].number;
+    return true;
+}
+// the cost of a chain of tests against n constants and of a table of range entries, a hit is as likely on any test
+static bool jump_table_cheaper(int n,int range){
+    cost_weighting weighting = current_weighting() == weigh_nothing ? weigh_speed : current_weighting();
+    lowering_cost compare = cheaper(weighting,shared_compare_cost,inline_compare_cost) ? shared_compare_cost : inline_compare_cost;
+    lowering_cost test = { 8 + 6 + compare.instructions + 5 + 2, 8 + 6 + compare.cycles + 5 };
+    lowering_cost chain = { n * test.instructions, (n + 1) * test.cycles / 2 };
+    lowering_cost table = { 8 + 16 + 2 * range, 8 + 18 };
+    return cheaper(weighting,table,chain);
+}
+static void find_jump_tables(vector<vm_command> &commands,vector<stack_rewrite> &rewrites){
+    jump_tables.clear();
+    next_jump_table = 0;
+
+    // the number of jumps to each label
+    symbols jumps = create_ints();
+    for (size_t i = 0; i < commands.size(); i++){
+        if (commands[i].op == vm_goto || commands[i].op == vm_if_goto){
+            update_ints(jumps,commands[i].label,max(0,lookup_ints(jumps,commands[i].label)) + 1);
+        }
+    }
+
+    size_t end = commands.size();
+    for (size_t i = 0; i < end; i++){
+        vm_command location;
+        int constant;
+        if (rewrites[i] != rewrite_none || !constant_test(commands,i,end,location,constant)){
+            continue;
+        }
+        // follow the chain along the false paths, tests[k] is the first command of each test
+        vector<size_t> tests;
+        jump_table table;
+        symbols seen = create_ints();
+        size_t at = i;
+        vm_command next_location;
+        int next_constant;
+        while (true){
+            tests.push_back(at);
+            if (insert_ints(seen,to_string(constant),1)){
+                table.cases.push_back(make_pair(constant,commands[at + 3].label));
+            }
+            // the false path is goto F or falls through to label F, the chain only continues if nothing else reaches F
+            if (at + 4 >= end || (commands[at + 4].op != vm_goto && commands[at + 4].op != vm_label)){
+                table.otherwise = "";
+                break;
+            }
+            table.otherwise = commands[at + 4].label;
+            int others = lookup_ints(jumps,table.otherwise) - (commands[at + 4].op == vm_goto ? 1 : 0);
+            size_t next = at + 5;
+            if (commands[at + 4].op == vm_goto){
+                int f = find_label(commands,at + 5,end,table.otherwise);
+                if (f < 0 || !unconditional(commands[f - 1])){
+                    break;
+                }
+                next = f + 1;
+            }
+            if (others > 0 || !constant_test(commands,next,end,next_location,next_constant) ||
+                !same_location(next_location,location) || rewrites[next] != rewrite_none){
+                break;
+            }
+            at = next;
+            constant = next_constant;
+        }
+        delete_ints(seen);
+
+        // the false path of the last test is where no constant matched
+        int low = table.cases[0].first;
+        int high = low;
+        for (size_t k = 0; k < table.cases.size(); k++){
+            low = min(low,table.cases[k].first);
+            high = max(high,table.cases[k].first);
+        }
+        int range = high - low + 1;
+        if (table.otherwise == "" || (int)tests.size() < JUMP_TABLE_MINIMUM || range > JUMP_TABLE_DENSITY * (int)table.cases.size() ||
+            !jump_table_cheaper(tests.size(),range)){
+            continue;
+        }
+
+        // push x stays, everything else in the tests goes, the first if-goto dispatches
+        for (size_t k = 0; k < tests.size(); k++){
+            size_t test = tests[k];
+            for (size_t c = k == 0 ? test + 1 : test; c <= test + 4 && c < end; c++){
+                if (commands[c].op != vm_label){
+                    rewrites[c] = rewrite_skip;
+                }
+            }
+        }
+        rewrites[tests[0] + 3] = rewrite_jump_table;
+        jump_tables.push_back(table);
+        i = tests[0] + 4;
+    }
+    delete_ints(jumps);
+}
+// *(SP - 1) is the value, D = value - high is in [1 - range,0] when it is in the table
+// entry k of the table is at last - 2 * (high - low - k) so the jump is to last + 2 * D
+static void output_jump_table(const jump_table &table){
+    int low = table.cases[0].first;
+    int high = low;
+    for (size_t k = 0; k < table.cases.size(); k++){
+        low = min(low,table.cases[k].first);
+        high = max(high,table.cases[k].first);
+    }
+    vector<string> targets(high - low + 1,"");
+    for (size_t k = 0; k < table.cases.size(); k++){
+        targets[table.cases[k].first - low] = table.cases[k].second;
+    }
+    int otherwise = vm_label_id(table.otherwise);
+    vm_label_jumped_to(otherwise);
+
+    pop_D();
+    if (low != 0){
+        A_instructions(to_string(low));
+        output_asm("D=D-A");
+    }
+    A_instructions(vm_label_name(otherwise));
+    output_asm("D;JLT");
+    A_instructions(to_string(high - low));
+    output_asm("D=D-A");
+    A_instructions(vm_label_name(otherwise));
+    output_asm("D;JGT");
+    string last = get_temp_label();
+    updata_counter();
+    output_asm("A=D");
+    output_asm("D=D+A");
+    A_instructions(last);
+    output_asm("A=D+A");
+    output_asm("0;JMP");
+    for (size_t k = 0; k < targets.size(); k++){
+        if (k + 1 == targets.size()){
+            output_label(last);
+        }
+        int id = targets[k] == "" ? otherwise : vm_label_id(targets[k]);
+        vm_label_jumped_to(id);
+        A_instructions(vm_label_name(id));
+        output_asm("0;JMP");
+    }
+}
+
+// intrinsics
+static void intrinsic_peek(){
+    // *(SP - 1) = RAM[*(SP - 1)]
+    register_to_A(SP);
+    output_asm("A=M-1");
+    output_asm("A=M");
+    output_asm("D=M");
+    register_to_A(SP);
+    output_asm("A=M-1");
+    output_asm("M=D");
+}
+static void intrinsic_poke(){
+    // RAM[*(SP - 2)] = *(SP - 1), the result is 0
+    two_operands();
+    output_asm("A=M");
+    output_asm("M=D");
+    register_to_A(SP);
+    output_asm("A=M-1");
+    output_asm("M=0");
+}
+static void intrinsic_abs(){
+    register_to_A(SP);
+    output_asm("A=M-1");
+    output_asm("D=M");
+    A_instructions(get_temp_label());
+    output_asm("D;JGE");
+    register_to_A(SP);
+    output_asm("A=M-1");
+    output_asm("M=-M");
+    add_temp_label();
+    updata_counter();
+}
+static void intrinsic_multiply(){
+    call_shared_routine(get_class_name() + "..multiply");
+    shared_multiply_used = true;
+}
+struct intrinsic
+{
+    const char *function;
+    int number;
+    void (*output)();
+};
+static const intrinsic intrinsics[] = {
+    { "Memory.peek",    1, intrinsic_peek },
+    { "Memory.poke",    2, intrinsic_poke },
+    { "Math.abs",       1, intrinsic_abs },
+    { "Math.multiply",  2, intrinsic_multiply }
+};
+// returns false if call label number is not an intrinsic
+static bool output_intrinsic(string label,int number){
+    for (size_t i = 0; i < sizeof(intrinsics) / sizeof(intrinsics[0]); i++){
+        if (label == intrinsics[i].function && number == intrinsics[i].number){
+            intrinsics[i].output();
+            return true;
+        }
+    }
+    return false;
+}
+
+// instrumentation counters
+// the first use of a key allocates the next counter, later uses share it
+static void output_counter(string key){
+    if (counter_keys.empty()){
+        counter_addresses = create_ints();
+    }
+    int address = lookup_ints(counter_addresses,key);
+    if (address < 0){
+        address = counter_base + counter_keys.size();
+        if (address >= COUNTER_LIMIT){
+            fatal_error(-1,"too many instrumentation counters, the counters must end before the screen at " + to_string(COUNTER_LIMIT) + "\n");
+        }
+        insert_ints(counter_addresses,key,address);
+        counter_keys.push_back(key);
+    }
+    A_instructions(to_string(address));
+    output_asm("M=M+1");
+}
+// the manifest lists one counter per line: <address> <key>
+// reading each address from RAM after a run and writing <key> <count> gives a profile for --profile
+static void write_instrument_manifest(){
+    ofstream file(instrument_manifest.c_str());
+    file << "# instrumentation counters: <address> <key>" << endl;
+    for (size_t i = 0; i < counter_keys.size(); i++){
+        file << counter_base + i << " " << counter_keys[i] << endl;
+    }
+    if (!file){
+        fatal_error(-1,"cannot write instrumentation manifest: " + instrument_manifest + "\n");
+    }
+}
+
+// source map
+static void write_source_map(){
+    ofstream file(source_map_file.c_str());
+    file << "# source map: <first ROM address> <ROM address after the last> <class> <function> <command index> <command>" << endl;
+    file << source_map;
+    if (!file){
+        fatal_error(-1,"cannot write source map: " + source_map_file + "\n");
+    }
+}
+
+// metrics report, phases are in seconds, kinds of VM command that were not seen are left out
+static string json_region(string name,const region_metrics &metrics){
+    return "    \"" + name + "\": { \"count\": " + to_string(metrics.count) +
+           ", \"instructions\": " + to_string(metrics.instructions) + " }";
+}
+static void write_metrics(){
+    start_phase(phase_none);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+
+    string commands = "";
+    int instructions = 0;
+    for (int op = 0; op < vm_oops; op++){
+        for (int segment = 0; segment <= vm_no_segment; segment++){
+            const region_metrics &metrics = command_metrics[op][segment];
+            if (metrics.count == 0){
+                continue;
+            }
+            string kind = vm_opcode_to_string((vm_opcode)op);
+            if (segment != vm_no_segment){
+                kind += " " + vm_segment_to_string((vm_segment)segment);
+            }
+            commands += (commands == "" ? "" : ",\n") + json_region(kind,metrics);
+            instructions += metrics.instructions;
+        }
+    }
+    string shared = "";
+    for (size_t i = 0; i < shared_metrics.size(); i++){
+        shared += (shared == "" ? "" : ",\n") + json_region(shared_metrics[i].first,shared_metrics[i].second);
+        instructions += shared_metrics[i].second.instructions;
+    }
+
+    ofstream file(metrics_file.c_str());
+    file.setf(ios::fixed);
+    file.precision(6);
+    file << "{" << endl;
+    file << "  \"class\": \"" << get_class_name() << "\"," << endl;
+    file << "  \"phases\": { \"parse\": " << phase_seconds[phase_parse] << ", \"translate\": " << phase_seconds[phase_translate]
+         << ", \"output\": " << phase_seconds[phase_output] << " }," << endl;
+    file << "  \"peak_memory_kb\": " << usage.ru_maxrss << "," << endl;
+    file << "  \"instructions\": " << instructions << "," << endl;
+    file << "  \"commands\": {" << (commands == "" ? "" : "\n" + commands + "\n  ") << "}," << endl;
+    file << "  \"shared_routines\": {" << (shared == "" ? "" : "\n" + shared + "\n  ") << "}" << endl;
+    file << "}" << endl;
+    if (!file){
+        fatal_error(-1,"cannot write metrics: " + metrics_file + "\n");
+    }
+}
+
+/************      END OF HELPER FUNCTIONS       **************/
+
+///////////////////////////////////////////////////////////////
+
+
+
+// the most threads the Pxml reader may use to scan a large document, 0 is one per processor
+static int parse_threads = 0 ;
+
+// buffered translation
+// the whole class passes never look beyond the end of a function so a buffered class is translated one function at a time
+// function_commands holds the commands of the function being read and is emptied once it has been translated,
+// its storage is reused by the next function so memory follows the largest function rather than the whole class
+static vector<vm_command> function_commands ;
+
+// true if whole class passes need every command of a function before its translation can start
+static bool buffer_functions()
+{
+    return profile_loaded || use_string_tables || forward_stores || use_jump_tables || hoist_invariants || cache_fields || (prologue != weigh_nothing && assembly_output) ;
+}
+
+// the function translate_vm_class() will be called by the main program
+// its is passed the abstract syntax tree constructed by the parser
+// it walks the abstract syntax tree and produces the equivalent VM code as output
+static void translate_vm_class(ast root)
+{
+    // assumes we have a "class" node containing VM command nodes
+    ast_mustbe_kind(root,ast_vm_class) ;
+    start_phase(phase_translate) ;
+
+    bool buffered = buffer_functions() ;
+
+    // tell the output system we are starting to translate VM commands for a Jack class
+    start_of_class() ;
+
+    int ncommands = size_of_vm_class(root) ;
+    for ( int i = 0 ; i < ncommands ; i++ )
+    {
+        vm_command command = vm_command_from_ast(get_vm_class(root,i)) ;
+        command.index = i ;
+        if ( buffered )
+        {
+            buffer_vm_command(command) ;
+        }
+        else
+        {
+            translate_vm_command(command) ;
+        }
+    }
+    if ( buffered ) translate_vm_function() ;
+
+    // tell the output system we have just finished translating VM commands for a Jack class
+    end_of_class() ;
+
+}
+
+// the readers call this as soon as they have read each command
+// context is 0 if the command can be translated immediately, otherwise it is the buffer of the current function
+static void translate_read_command(const vm_command &command,void *context)
+{
+    if ( context != 0 )
+    {
+        buffer_vm_command(command) ;
+    }
+    else
+    {
+        start_phase(phase_translate) ;
+        translate_vm_command(command) ;
+        start_phase(phase_parse) ;
+    }
+}
+
+// the function translate_vm_file() is used instead of translate_vm_class() when main is given a file
+// a .vmb file is decoded by the binary loader, anything else is scanned by the Pxml reader
+// each command is translated as soon as it is read unless the whole class must be buffered first
+static void translate_vm_file(string path)
+{
+    start_phase(phase_parse) ;
+    void *context = buffer_functions() ? &function_commands : 0 ;
+
+    // tell the output system we are starting to translate VM commands for a Jack class
+    start_of_class() ;
+
+    if ( path.size() > 4 && path.compare(path.size() - 4,4,".vmb") == 0 )
+    {
+        vmb_read_file(path,translate_read_command,context) ;
+    }
+    else
+    {
+        pxml_read_file(path,translate_read_command,context,parse_threads) ;
+    }
+
+    if ( context != 0 ) translate_vm_function() ;
+
+    // tell the output system we have just finished translating VM commands for a Jack class
+    end_of_class() ;
+}
+
+// the function translate_vm_memory() translates a document already in memory, a batch request's inline document
+// it is a .vmb command stream if it starts with the .vmb magic number, otherwise it is Pxml
+static void translate_vm_memory(const char *bytes,size_t length)
+{
+    start_phase(phase_parse) ;
+    void *context = buffer_functions() ? &function_commands : 0 ;
+
+    // tell the output system we are starting to translate VM commands for a Jack class
+    start_of_class() ;
+
+    if ( vmb_is_binary(bytes,length) )
+    {
+        vmb_read_memory(bytes,length,translate_read_command,context) ;
+    }
+    else
+    {
+        pxml_read_memory(bytes,length,translate_read_command,context,parse_threads) ;
+    }
+
+    if ( context != 0 ) translate_vm_function() ;
+
+    // tell the output system we have just finished translating VM commands for a Jack class
+    end_of_class() ;
+}
+
+// buffer a command, the buffered function is translated when the next one starts
+static void buffer_vm_command(const vm_command &command)
+{
+    if ( command.op == vm_function && !function_commands.empty() ) translate_vm_function() ;
+    function_commands.push_back(command) ;
+}
+
+// the function translate_vm_function() runs the whole class passes over the buffered function then translates it
+// the commands before a class's first function command, if any, are translated as a function of their own
+static void translate_vm_function()
+{
+    start_phase(phase_translate) ;
+    vector<vm_command> &commands = function_commands ;
+    if ( hoist_invariants ) hoist_loop_invariants(commands) ;
+    if ( profile_loaded ) layout_cold_branches(commands) ;
+
+    vector<stack_rewrite> rewrites(commands.size(),rewrite_none) ;
+    if ( forward_stores ) find_stack_rewrites(commands,rewrites) ;
+    if ( use_jump_tables ) find_jump_tables(commands,rewrites) ;
+
+    for ( size_t i = 0 ; i < commands.size() ; i++ )
+    {
+        if ( prologue != weigh_nothing && assembly_output && commands[i].op == vm_function ) find_locals_written_first(commands,i) ;
+
+        if ( rewrites[i] != rewrite_none )
+        {
+            cached_base = -1 ;
+            start_of_command(commands[i]) ;
+            output_stack_rewrite(commands[i],rewrites[i]) ;
+            end_of_command() ;
+            continue ;
+        }
+
+        int characters = use_string_tables ? string_table_length(commands,i) : 0 ;
+        if ( characters == 0 )
+        {
+            field_cache_wanted = cache_fields && field_reused(commands,rewrites,i) ;
+            translate_vm_command(commands[i]) ;
+            continue ;
+        }
+
+        // each push constant c becomes a table entry and its call String.appendChar 2 disappears
+        for ( int c = 0 ; c < characters ; c++, i += 2 )
+        {
+            start_of_command(commands[i]) ;
+            if ( c == 0 ) output_string_table_start() ;
+            output_string_table_entry(commands[i].number) ;
+            end_of_command() ;
+
+            start_of_command(commands[i + 1]) ;
+            end_of_command() ;
+        }
+        i-- ;
+    }
+
+    // release the function's commands, the vector keeps its storage for the next function
+    commands.clear() ;
+}
+
+// translate the current vm command - a bad command is a fatal error
+static void translate_vm_command(const vm_command &command)
+{
+    if ( vm_is_operator(command.op) )
+    {
+        translate_vm_operator(command) ;
+    }
+    else if ( vm_is_jump(command.op) )
+    {
+        translate_vm_jump(command) ;
+    }
+    else if ( vm_is_function(command.op) )
+    {
+        translate_vm_func(command) ;
+    }
+    else if ( vm_is_stack(command.op) )
+    {
+        translate_vm_stack(command) ;
+    }
+    else
+    {
+        fatal_error(0,"// bad node - expected vm_operator, vm_jump, vm_function or vm_stack\n") ;
+    }
+}
+
+// the translation of an operator or stack command by its helper, used when it has no template
+static void output_operator_helper(const vm_command &vm_op){
+    switch (vm_op.op){
+    case vm_add:    op_add();       break;
+    case vm_return: output_return();    break;
+    case vm_and:    op_and();       break;
+    case vm_eq:     op_eq();        break;
+    case vm_gt:     op_gt();        break;
+    case vm_lt:     op_lt();        break;
+    case vm_neg:    op_neg();       break;
+    case vm_not:    op_not();       break;
+    case vm_or:     op_or();        break;
+    default:        op_sub();       break;
+    }
+}
+static void output_stack_helper(const vm_command &stack){
+    int number = stack.number;
+    if (stack.op == vm_push){
+        switch (stack.segment){
+        case vm_static:     push_static_lowered(number);                break;
+        case vm_constant:   push_constant_lowered(number);              break;
+        case vm_temp:       push_temp(number);                          break;
+        case vm_pointer:    push_pointer(number);                       break;
+        case vm_local:      push_segment(LCL, number);                  break;
+        case vm_argument:   push_segment(ARG, number);                  break;
+        case vm_that:       push_segment(THAT, number);                 break;
+        case vm_this:       push_segment(THIS, number);                 break;
+        default:                                                        break;
+        }
+    }else{ // pop
+        switch (stack.segment){
+        case vm_static:     pop_static(number);                         break;
+        case vm_temp:       pop_temp(number);                           break;
+        case vm_pointer:    pop_pointer(number);                        break;
+        case vm_local:      pop_segment(LCL, number);                   break;
+        case vm_argument:   pop_segment(ARG, number);                   break;
+        case vm_that:       pop_segment(THAT, number);                  break;
+        case vm_this:       pop_segment(THIS, number);                  break;
+        default:                                                        break;
+        }
+    }
+}
+// each operator and stack template must be exactly what its helper outputs with nothing weighed,
+// main() compares the two for a sample command before translating anything, goto and if-goto have no helper
+static void check_template(const instruction_template *tpl,const vm_command &command,const string &helper){
+    if (template_text(tpl,command.op == vm_push || command.op == vm_pop ? template_operand(command) : "") != helper){
+        fatal_error(-1,"the instruction template for " + vm_command_to_string(command) + " differs from its helper\n");
+    }
+}
+static void check_templates(){
+    string helper;
+    captured_asm = &helper;
+    for (int op = vm_add; op <= vm_sub; op++){
+        vm_command command = make_command((vm_opcode)op,vm_no_segment,0);
+        if (command_templates[op].text == 0) continue;
+        helper.clear();
+        output_operator_helper(command);
+        check_template(&command_templates[op],command,helper);
+    }
+    for (int segment = vm_argument; segment <= vm_this; segment++){
+        vm_command push = make_command(vm_push,(vm_segment)segment,1);
+        helper.clear();
+        output_stack_helper(push);
+        check_template(&push_templates[segment],push,helper);
+        if (segment == vm_constant) continue;
+        vm_command pop = make_command(vm_pop,(vm_segment)segment,1);
+        helper.clear();
+        output_stack_helper(pop);
+        check_template(&pop_templates[segment],pop,helper);
+    }
+    captured_asm = 0;
+}
+
+// translate vm operator command into assembly language
+static void translate_vm_operator(const vm_command &vm_op)
+{
+    // tell the output system what kind of VM command we are now trying to implement
+    start_of_command(vm_op) ;
+
+    /************   ADD CODE BETWEEN HERE   **************/
+
+    // use the output_asm() function to implement this VM command in Hack Assembler
+    // careful use of helper functions you can define above will keep your code simple
+    // ...
+    const instruction_template *tpl = find_template(vm_op);
+    if (tpl != 0){
+        output_template(tpl,"");
+    }else{
+        output_operator_helper(vm_op);
+    }
+
+    /************         AND HERE          **************/
+
+    // tell the output system that we have just finished trying to implement a VM command
+    end_of_command() ;
+}
+
+// translate vm operator command into assembly language
+static void translate_vm_jump(const vm_command &jump)
+{
+    // extract command specific info from the command passed in
+    const string &label = jump.label ;
+
+    // tell the output system what kind of VM command we are now trying to implement
+    start_of_command(jump) ;
+
+    /************   ADD CODE BETWEEN HERE   **************/
+
+    // use the output_asm() function to implement this VM command in Hack Assembler
+    // careful use of helper functions you can define above will keep your code simple
+    // ...
+    int id = vm_label_id(label);
+    if (jump.op == vm_label){
+        vm_label_defined(id);
+        output_label(vm_label_name(id));
+        if (instrument_labels){
+            output_counter(vm_label_name(id));
+        }
+    }else{ // goto or if-goto
+        vm_label_jumped_to(id);
+        output_template(find_template(jump),vm_label_name(id));
+    }
+
+    /************         AND HERE          **************/
+
+    // tell the output system that we have just finished trying to implement a VM command
+    end_of_command() ;
+}
+
+// translate vm operator command into assembly language
+static void translate_vm_func(const vm_command &func)
+{
+    // extract command specific info from the command passed in
+    string command = vm_opcode_to_string(func.op) ;
+    const string &label = func.label ;
+    int number = func.number ;
+
+    // tell the output system what kind of VM command we are now trying to implement
+    start_of_command(func) ;
+
+    /************   ADD CODE BETWEEN HERE   **************/
+
+    // function ::= 'call' | 'function'
+    output_asm("// "+command+" " + label +" "+to_string(number)) ; 
+    if (func.op == vm_function){
+        output_function(label,number);
+    }else{ // call 
+        output_call(label,number);
+    }
+
+    /************         AND HERE          **************/
+
+    // tell the output system that we have just finished trying to implement a VM command
+    end_of_command() ;
+}
+
+// translate vm operator command into assembly language
+static void translate_vm_stack(const vm_command &stack)
+{
+    // extract command specific info from the command passed in
+    string command = vm_opcode_to_string(stack.op) ;
+    string segment = vm_segment_to_string(stack.segment) ;
+    int number = stack.number ;
+
+    // tell the output system what kind of VM command we are now trying to implement
+    start_of_command(stack) ;
+
+    /************   ADD CODE BETWEEN HERE   **************/
+
+    // use the output_asm() function to implement this VM command in Hack Assembler
+    // careful use of helper functions you can define above will keep your code simple
+    // ...
+    output_asm("// "+command+" " + segment +" "+to_string(number)) ; 
+
+    const instruction_template *tpl = find_template(stack);
+    string cell = leaf_cell(stack);
+    if (cell != "" && stack.op == vm_push){
+        A_instructions(cell);
+        output_asm("D=M");
+        push_D();
+    }else if (cell != ""){
+        pop_D();
+        A_instructions(cell);
+        output_asm("M=D");
+    }else if (tpl != 0){
+        output_template(tpl,template_operand(stack));
+    }else{
+        output_stack_helper(stack);
+    }
+
+    /************         AND HERE          **************/
+
+    // tell the output system that we have just finished trying to implement a VM command
+    end_of_command() ;
+}
+
+// command line options, also used by the options of each batch request
+// returns false if arg is not an option
+static bool parse_option(string arg)
+{
+    if ( arg == "--asm" )
+    {
+        assembly_output = true ;
+    }
+    else if ( arg.compare(0,10,"--profile=") == 0 )
+    {
+        read_profile(arg.substr(10)) ;
+        assembly_output = true ;
+    }
+    else if ( arg.compare(0,13,"--instrument=") == 0 )
+    {
+        instrument_manifest = arg.substr(13) ;
+        instrument_functions = true ;
+        assembly_output = true ;
+    }
+    else if ( arg == "--instrument-labels" )
+    {
+        instrument_labels = true ;
+    }
+    else if ( arg.compare(0,15,"--counter-base=") == 0 )
+    {
+        counter_base = atoi(arg.substr(15).c_str()) ;
+    }
+    else if ( arg == "--intrinsics" )
+    {
+        use_intrinsics = true ;
+        assembly_output = true ;
+    }
+    else if ( arg == "--shared-returns=function" || arg == "--shared-returns=class" )
+    {
+        shared_returns = arg == "--shared-returns=function" ? return_per_function : return_per_class ;
+        assembly_output = true ;
+    }
+    else if ( arg == "--prologue=speed" || arg == "--prologue=size" )
+    {
+        prologue = arg == "--prologue=speed" ? weigh_speed : weigh_size ;
+    }
+    else if ( arg == "-O0" )
+    {
+        level_weighting = weigh_nothing ;
+    }
+    else if ( arg == "-O1" || arg == "-O2" )
+    {
+        level_weighting = weigh_speed ;
+        prologue = weigh_speed ;
+        hoist_invariants = true ;
+        if ( arg == "-O2" )
+        {
+            use_intrinsics = true ;
+            forward_stores = true ;
+            use_jump_tables = true ;
+            cache_fields = true ;
+            assembly_output = true ;
+        }
+    }
+    else if ( arg == "-Os" )
+    {
+        level_weighting = weigh_size ;
+        prologue = weigh_size ;
+        use_intrinsics = true ;
+        use_string_tables = true ;
+        forward_stores = true ;
+        use_jump_tables = true ;
+        cache_fields = true ;
+        assembly_output = true ;
+    }
+    else if ( arg == "--cache-fields" )
+    {
+        cache_fields = true ;
+        assembly_output = true ;
+    }
+    else if ( arg == "--hoist" )
+    {
+        hoist_invariants = true ;
+    }
+    else if ( arg == "--forward-stores" )
+    {
+        forward_stores = true ;
+        assembly_output = true ;
+    }
+    else if ( arg == "--jump-tables" )
+    {
+        use_jump_tables = true ;
+        assembly_output = true ;
+    }
+    else if ( arg == "--string-tables" )
+    {
+        use_string_tables = true ;
+        assembly_output = true ;
+    }
+    else if ( arg.compare(0,13,"--source-map=") == 0 )
+    {
+        source_map_file = arg.substr(13) ;
+    }
+    else if ( arg.compare(0,10,"--metrics=") == 0 )
+    {
+        metrics_file = arg.substr(10) ;
+    }
+    else if ( arg.compare(0,16,"--parse-threads=") == 0 )
+    {
+        parse_threads = atoi(arg.substr(16).c_str()) ;
+    }
+    else if ( arg.compare(0,10,"--program=") == 0 )
+    {
+        vm_program_read(arg.substr(10)) ;
+        whole_program = true ;
+        assembly_output = true ;
+    }
+    else
+    {
+        return false ;
+    }
+    return true ;
+}
+
+// checks that apply once all options have been seen
+static void check_options()
+{
+    if ( instrument_labels && !instrument_functions )
+    {
+        fatal_error(-1,"--instrument-labels requires --instrument=<manifest>\n") ;
+    }
+    // every address in range is used by something, statics below 256, the stack below 2048 and the OS heap above,
+    // the counters only stay correct if the program never reaches them
+    if ( counter_base < 16 || counter_base >= COUNTER_LIMIT )
+    {
+        fatal_error(-1,"--counter-base must be in the range 16 to " + to_string(COUNTER_LIMIT - 1) + "\n") ;
+    }
+}
+
+// translator state
+// a batch translates many classes in one process so every global above is put back to its initial value between requests
+static void reset_translator()
+{
+    class_name = "Unknown" ;
+    function_name = "unknown" ;
+    label_prefix = VM_UNKNOWN_FUNCTION "$" ;
+    vm_labels_end_function(false) ;
+    counter = 0 ;
+    assembly_output = false ;
+    rom_address = 0 ;
+    level_weighting = weigh_nothing ;
+    source_map_file = "" ;
+    source_map = "" ;
+    command_start_address = 0 ;
+    function_commands.clear() ;
+    parse_threads = 0 ;
+    metrics_file = "" ;
+    current_phase = phase_none ;
+    phase_started = 0 ;
+    for ( int phase = 0 ; phase < phase_none ; phase++ ) phase_seconds[phase] = 0 ;
+    memset(command_metrics,0,sizeof(command_metrics)) ;
+    shared_metrics.clear() ;
+    use_string_tables = false ;
+    shared_returns = return_inline ;
+    prologue = weigh_nothing ;
+    locals_written_first.clear() ;
+    hoist_invariants = false ;
+    cache_fields = false ;
+    cached_base = -1 ;
+    cached_offset = 0 ;
+    field_cache_wanted = false ;
+    forward_stores = false ;
+    use_jump_tables = false ;
+    jump_tables.clear() ;
+    next_jump_table = 0 ;
+    use_intrinsics = false ;
+    vm_program_clear() ;
+    whole_program = false ;
+    in_register_leaf = false ;
+    current_frame = FULL_FRAME ;
+    if ( profile_loaded ) delete_ints(profile_counts) ;
+    profile_loaded = false ;
+    profile_hot_threshold = 1 ;
+    instrument_functions = false ;
+    instrument_labels = false ;
+    instrument_manifest = "" ;
+    counter_base = COUNTER_BASE ;
+    if ( !counter_keys.empty() ) delete_ints(counter_addresses) ;
+    counter_keys.clear() ;
+}
+
+// batch translation
+// requests are read from a stream and each is answered before the next is read
+// request ::=  header '\n' document
+// header ::=   length option* path?
+// response ::= status ' ' output_length ' ' errors_length '\n' output errors
+// status ::=   'ok' | 'error'
+// - if length is 0 the class is read from path, otherwise document is the next length bytes, Pxml or .vmb
+// - every request starts from the state given by the translator's own command line options
+// - requests are translated by a worker process, a fatal error only ends the worker,
+//   its error messages become the 'error' response and a new worker reads the next request
+// - the checked output system can only translate one class per process, so a worker
+//   also ends after a request without --asm
+static vector<string> batch_options ;
+
+// the worker's progress, shared with the supervisor
+enum worker_state { worker_reading, worker_translating, worker_finished } ;
+
+static bool read_bytes(int fd,char *bytes,size_t length)
+{
+    while ( length > 0 )
+    {
+        ssize_t n = read(fd,bytes,length) ;
+        if ( n < 0 && errno == EINTR ) continue ;
+        if ( n <= 0 ) return false ;
+        bytes += n ;
+        length -= n ;
+    }
+    return true ;
+}
+
+static void write_bytes(int fd,const char *bytes,size_t length)
+{
+    while ( length > 0 )
+    {
+        ssize_t n = write(fd,bytes,length) ;
+        if ( n < 0 && errno == EINTR ) continue ;
+        if ( n <= 0 ) _exit(-1) ;
+        bytes += n ;
+        length -= n ;
+    }
+}
+
+// the header is read one byte at a time so a new worker starts exactly at the next request
+static bool read_header(int fd,string &header)
+{
+    header.clear() ;
+    char c ;
+    while ( read_bytes(fd,&c,1) )
+    {
+        if ( c == '\n' ) return true ;
+        header += c ;
+    }
+    return false ;
+}
+
+static void write_response(int fd,string status,const string &output,const string &errors)
+{
+    string response = status + " " + to_string(output.size()) + " " + to_string(errors.size()) + "\n" + output + errors ;
+    write_bytes(fd,response.data(),response.size()) ;
+}
+
+// everything written to fd since it was last emptied
+static string take_file_contents(int fd)
+{
+    string contents ;
+    char bytes[4096] ;
+    lseek(fd,0,SEEK_SET) ;
+    for ( ssize_t n ; (n = read(fd,bytes,sizeof(bytes))) > 0 ; ) contents.append(bytes,n) ;
+    lseek(fd,0,SEEK_SET) ;
+    if ( ftruncate(fd,0) != 0 ) _exit(-1) ;
+    return contents ;
+}
+
+// translate one request, the output is collected from cout and the errors from fd 2
+static void translate_request(int out,string header,const string &document)
+{
+    istringstream fields(header) ;
+    string length, word, path = "" ;
+    fields >> length ;
+
+    reset_translator() ;
+    for ( size_t i = 0 ; i < batch_options.size() ; i++ ) parse_option(batch_options[i]) ;
+    while ( fields >> word )
+    {
+        if ( word[0] != '-' && path == "" )
+        {
+            path = word ;
+        }
+        else if ( word[0] != '-' || !parse_option(word) )
+        {
+            write_response(out,"error","","bad request option: " + word + "\n") ;
+            return ;
+        }
+    }
+    check_options() ;
+    if ( document.empty() && path == "" )
+    {
+        write_response(out,"error","","request has no document or path\n") ;
+        return ;
+    }
+
+    ostringstream output ;
+    streambuf *stdout_buffer = cout.rdbuf(output.rdbuf()) ;
+
+    if ( !document.empty() )
+    {
+        translate_vm_memory(document.data(),document.size()) ;
+    }
+    else
+    {
+        translate_vm_file(path) ;
+    }
+    start_phase(phase_output) ;
+    if ( instrument_functions ) write_instrument_manifest() ;
+    if ( source_map_file != "" ) write_source_map() ;
+    print_output() ;
+    if ( metrics_file != "" ) write_metrics() ;
+    print_errors() ;
+
+    cout.rdbuf(stdout_buffer) ;
+    write_response(out,"ok",output.str(),take_file_contents(2)) ;
+}
+
+// the worker, state is shared with the supervisor
+static void serve_requests(int in,int out,volatile worker_state *state)
+{
+    string header, document ;
+    while ( read_header(in,header) )
+    {
+        int length = atoi(header.c_str()) ;
+        if ( length < 0 || header.find_first_not_of("0123456789") == 0 )
+        {
+            write_response(out,"error","","bad request header: " + header + "\n") ;
+            continue ;
+        }
+        document.resize(length) ;
+        if ( !read_bytes(in,&document[0],length) ) break ;
+
+        *state = worker_translating ;
+        take_file_contents(2) ;
+        translate_request(out,header,document) ;
+        *state = worker_reading ;
+        if ( !assembly_output ) return ;
+    }
+    *state = worker_finished ;
+}
+
+// the supervisor, starts a new worker whenever one ends before the end of the requests
+static void serve_batch(int in,int out)
+{
+    FILE *errors = tmpfile() ;
+    void *shared = mmap(0,sizeof(worker_state),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0) ;
+    if ( errors == 0 || shared == MAP_FAILED ) fatal_error(-1,"cannot start batch worker\n") ;
+    volatile worker_state *state = (volatile worker_state *)shared ;
+
+    for (;;)
+    {
+        *state = worker_reading ;
+        pid_t worker = fork() ;
+        if ( worker < 0 ) fatal_error(-1,"cannot start batch worker\n") ;
+        if ( worker == 0 )
+        {
+            dup2(fileno(errors),2) ;
+            serve_requests(in,out,state) ;
+            _exit(0) ;
+        }
+
+        int status ;
+        while ( waitpid(worker,&status,0) < 0 && errno == EINTR ) ;
+        if ( *state == worker_finished ) break ;
+        if ( *state == worker_translating ) write_response(out,"error","",take_file_contents(fileno(errors))) ;
+    }
+
+    munmap(shared,sizeof(worker_state)) ;
+    fclose(errors) ;
+}
+
+// answers one connection at a time on the Unix socket path
+static void serve_socket(string path)
+{
+    struct sockaddr_un address ;
+    memset(&address,0,sizeof(address)) ;
+    address.sun_family = AF_UNIX ;
+    if ( path.size() >= sizeof(address.sun_path) ) fatal_error(-1,"socket path is too long: " + path + "\n") ;
+    strcpy(address.sun_path,path.c_str()) ;
+
+    // a socket left behind by an earlier server is replaced, any other file at path is kept
+    struct stat existing ;
+    if ( lstat(path.c_str(),&existing) == 0 )
+    {
+        if ( !S_ISSOCK(existing.st_mode) ) fatal_error(-1,"not a socket, will not replace: " + path + "\n") ;
+        unlink(path.c_str()) ;
+    }
+
+    int listener = socket(AF_UNIX,SOCK_STREAM,0) ;
+    if ( listener < 0 || bind(listener,(struct sockaddr *)&address,sizeof(address)) != 0 || listen(listener,16) != 0 )
+    {
+        fatal_error(-1,"cannot listen on socket: " + path + "\n") ;
+    }
+
+    for (;;)
+    {
+        int connection = accept(listener,0,0) ;
+        if ( connection < 0 ) continue ;
+        serve_batch(connection,connection) ;
+        close(connection) ;
+    }
+}
+
+// main program
+// with no file argument the abstract syntax tree is parsed from standard input
+// translator <file.Pxml> reads the Pxml file with the memory mapped reader instead
+// translator <file.vmb> loads a binary command stream written by vm-convert
+// translator --batch answers a stream of length delimited translation requests on standard input
+// translator --server=<socket> answers the same requests on each connection to a Unix socket, see batch translation
+// an existing socket at that path is replaced, any other existing file is an error
+//
+// options:
+// -O0|-O1|-O2|-Os   the optimisation level, see the cost model, the default is -O0
+// --asm              write plain Hack assembly instead of using the checked output system
+// --profile=<file>   use the execution counts in file to lay out branches and weigh cold functions for size, implies --asm
+// --instrument=<manifest>  count function entries and calls in RAM, the counter addresses are written to manifest, implies --asm
+// --instrument-labels      also count arrivals at every label, requires --instrument
+// --counter-base=<address> RAM address of the first counter, the default is 15872, inside the Jack OS heap
+// --source-map=<file>      record the ROM addresses generated for each VM command in file
+// --metrics=<file>         write a JSON report of the parse, translate and output times, peak memory
+//                          and the count and instructions of each kind of VM command and shared routine
+// --parse-threads=<n>      scan a Pxml file of 1MB or more with up to n threads, the default 0 is one per processor
+// --program=<file>        file lists the Pxml or .vmb files of every class of the program, small leaf functions
+//                          called only by the program are called without a frame, see register_leaf(), and
+//                          frames only save the pointers the callee pops, see function_frame(), implies --asm
+// --intrinsics             replace calls of Memory.peek, Memory.poke, Math.abs and Math.multiply with inline code, implies --asm
+// --shared-returns=function|class
+//                          later returns in a function, or class, jump to the first one's epilogue, implies --asm
+// --prologue=speed|size    zero locals with the fastest, or smallest, of unrolled pushes, a bulk fill or a loop
+//                          and do not zero locals written before they are read
+// --cache-fields           keep the address of a this or that field in R15 for the next field accesses in straight line code, implies --asm
+// --hoist                  load loop invariant values once before each loop and keep them in extra locals
+// --forward-stores         keep popped values on the stack when they are pushed straight back and drop dead temp stores, implies --asm
+// --jump-tables            dispatch else if chains testing one location against dense constants through a table of jumps, implies --asm
+// --string-tables          build string literals from a table of characters and one shared routine, implies --asm
+int main(int argc,char **argv)
+{
+    check_templates() ;
+
+    string path = "" ;
+    string server = "" ;
+    bool batch = false ;
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        string arg = argv[i] ;
+        if ( parse_option(arg) )
+        {
+            batch_options.push_back(arg) ;
+        }
+        else if ( arg == "--batch" && !batch && server == "" && path == "" )
+        {
+            batch = true ;
+        }
+        else if ( arg.compare(0,9,"--server=") == 0 && !batch && server == "" && path == "" )
+        {
+            server = arg.substr(9) ;
+        }
+        else if ( arg[0] == '-' || path != "" || batch || server != "" )
+        {
+            fatal_error(-1,"usage: translator [-O0|-O1|-O2|-Os] [--asm] [--profile=<file>] [--instrument=<manifest> [--instrument-labels] [--counter-base=<address>]] [--source-map=<file>] [--metrics=<file>] [--parse-threads=<n>] [--program=<file>] [--intrinsics] [--shared-returns=function|class] [--prologue=speed|size] [--cache-fields] [--hoist] [--forward-stores] [--jump-tables] [--string-tables] [--batch|--server=<socket>|file.Pxml|file.vmb]\n") ;
+        }
+        else
+        {
+            path = arg ;
+        }
+    }
+    check_options() ;
+
+    if ( batch )
+    {
+        serve_batch(0,1) ;
+        return 0 ;
+    }
+    if ( server != "" )
+    {
+        serve_socket(server) ;
+        return 0 ;
+    }
+
+    if ( path != "" )
+    {
+        // scan the file and translate each command as it is read
+        translate_vm_file(path) ;
+    }
+    else
+    {
+        // parse abstract syntax tree and pass to the translator
+        start_phase(phase_parse) ;
+        translate_vm_class(ast_parse_xml()) ;
+    }
+    start_phase(phase_output) ;
+    if ( instrument_functions ) write_instrument_manifest() ;
+    if ( source_map_file != "" ) write_source_map() ;
+
     // flush output and errors
     print_output() ;
+    if ( metrics_file != "" ) write_metrics() ;
     print_errors() ;
 }
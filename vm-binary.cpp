@@ -0,0 +1,208 @@
+// reading and writing the compact .vmb command stream
+#include "iobuffer.h"
+#include "symbols.h"
+#include "vm-binary.h"
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+using namespace CS_Symbol_Tables ;
+
+namespace Hack_Virtual_Machine
+{
+    static const char vmb_magic[] = { 'H', 'V', 'M', 'B' } ;
+    static const int vmb_version = 1 ;
+
+    bool vmb_is_binary(const char *bytes,size_t length)
+    {
+        return length >= sizeof(vmb_magic) && memcmp(bytes,vmb_magic,sizeof(vmb_magic)) == 0 ;
+    }
+
+    // encoding
+    static void put_varint(string &out,unsigned int n)
+    {
+        while ( n >= 0x80 )
+        {
+            out += (char)(0x80 | (n & 0x7f)) ;
+            n >>= 7 ;
+        }
+        out += (char)n ;
+    }
+
+    string vmb_encode(const vector<vm_command> &commands)
+    {
+        // number the labels in order of first use
+        symbols label_index = create_ints() ;
+        vector<const string *> labels ;
+        for ( size_t i = 0 ; i < commands.size() ; i++ )
+        {
+            if ( !vm_is_jump(commands[i].op) && !vm_is_function(commands[i].op) ) continue ;
+            if ( insert_ints(label_index,commands[i].label,labels.size()) ) labels.push_back(&commands[i].label) ;
+        }
+
+        string out(vmb_magic,sizeof(vmb_magic)) ;
+        out += (char)vmb_version ;
+
+        put_varint(out,labels.size()) ;
+        for ( size_t i = 0 ; i < labels.size() ; i++ )
+        {
+            put_varint(out,labels[i]->size()) ;
+            out += *labels[i] ;
+        }
+
+        put_varint(out,commands.size()) ;
+        for ( size_t i = 0 ; i < commands.size() ; i++ )
+        {
+            const vm_command &command = commands[i] ;
+            out += (char)command.op ;
+            if ( vm_is_jump(command.op) )
+            {
+                put_varint(out,lookup_ints(label_index,command.label)) ;
+            }
+            else if ( vm_is_function(command.op) )
+            {
+                put_varint(out,lookup_ints(label_index,command.label)) ;
+                put_varint(out,command.number) ;
+            }
+            else if ( vm_is_stack(command.op) )
+            {
+                out += (char)command.segment ;
+                put_varint(out,command.number) ;
+            }
+        }
+
+        delete_ints(label_index) ;
+        return out ;
+    }
+
+    void vmb_write_file(string path,const vector<vm_command> &commands)
+    {
+        string bytes = vmb_encode(commands) ;
+
+        FILE *file = fopen(path.c_str(),"wb") ;
+        if ( file == 0 ) fatal_error(-1,"cannot create vmb file: " + path + "\n") ;
+        size_t written = fwrite(bytes.data(),1,bytes.size(),file) ;
+        if ( fclose(file) != 0 || written != bytes.size() ) fatal_error(-1,"cannot write vmb file: " + path + "\n") ;
+    }
+
+    // decoding, p is the next unread byte
+    struct vmb_decoder
+    {
+        const unsigned char *p ;
+        const unsigned char *end ;
+    } ;
+
+    static void decode_error(string message)
+    {
+        fatal_error(-1,"vmb: " + message + "\n") ;
+    }
+
+    static int get_byte(vmb_decoder &d)
+    {
+        if ( d.p >= d.end ) decode_error("unexpected end of file") ;
+        return *d.p++ ;
+    }
+
+    static unsigned int get_varint(vmb_decoder &d)
+    {
+        unsigned int n = 0 ;
+        for ( int shift = 0 ; shift < 32 ; shift += 7 )
+        {
+            int byte = get_byte(d) ;
+            n |= (unsigned int)(byte & 0x7f) << shift ;
+            if ( (byte & 0x80) == 0 ) return n ;
+        }
+        decode_error("varint is too long") ;
+        return 0 ;
+    }
+
+    static int get_number(vmb_decoder &d)
+    {
+        unsigned int n = get_varint(d) ;
+        if ( n > 32767 ) decode_error("number out of range: " + to_string(n)) ;
+        return n ;
+    }
+
+    void vmb_read_memory(const char *bytes,size_t length,vm_command_handler handler,void *context)
+    {
+        if ( !vmb_is_binary(bytes,length) ) decode_error("missing magic number") ;
+
+        vmb_decoder d ;
+        d.p = (const unsigned char *)bytes + sizeof(vmb_magic) ;
+        d.end = (const unsigned char *)bytes + length ;
+
+        if ( get_byte(d) != vmb_version ) decode_error("unsupported version") ;
+
+        // the label table, each label string is constructed exactly once
+        unsigned int nlabels = get_varint(d) ;
+        vector<string> labels ;
+        for ( unsigned int i = 0 ; i < nlabels ; i++ )
+        {
+            unsigned int size = get_varint(d) ;
+            if ( size > (size_t)(d.end - d.p) ) decode_error("label runs past the end of file") ;
+            labels.push_back(string((const char *)d.p,size)) ;
+            d.p += size ;
+        }
+
+        vm_command command ;
+        unsigned int ncommands = get_varint(d) ;
+        for ( unsigned int i = 0 ; i < ncommands ; i++ )
+        {
+            int op = get_byte(d) ;
+            if ( op >= vm_oops ) decode_error("bad opcode: " + to_string(op)) ;
+
+            command.op = (vm_opcode)op ;
+            command.segment = vm_no_segment ;
+            command.number = 0 ;
+            command.label.clear() ;
+            command.index = i ;
+
+            if ( vm_is_jump(command.op) || vm_is_function(command.op) )
+            {
+                unsigned int index = get_varint(d) ;
+                if ( index >= labels.size() ) decode_error("bad label index: " + to_string(index)) ;
+                command.label = labels[index] ;
+                if ( vm_is_function(command.op) ) command.number = get_number(d) ;
+            }
+            else if ( vm_is_stack(command.op) )
+            {
+                int segment = get_byte(d) ;
+                if ( segment >= vm_no_segment ) decode_error("bad segment: " + to_string(segment)) ;
+                command.segment = (vm_segment)segment ;
+                command.number = get_number(d) ;
+            }
+
+            handler(command,context) ;
+        }
+
+        if ( d.p != d.end ) decode_error("unexpected bytes after the last command") ;
+    }
+
+    void vmb_read_file(string path,vm_command_handler handler,void *context)
+    {
+        int fd = open(path.c_str(),O_RDONLY) ;
+        if ( fd < 0 ) fatal_error(-1,"cannot open vmb file: " + path + "\n") ;
+
+        struct stat info ;
+        if ( fstat(fd,&info) != 0 || info.st_size == 0 )
+        {
+            close(fd) ;
+            fatal_error(-1,"cannot read vmb file: " + path + "\n") ;
+        }
+
+        size_t length = info.st_size ;
+        void *mapped = mmap(0,length,PROT_READ,MAP_PRIVATE,fd,0) ;
+        close(fd) ;
+        if ( mapped == MAP_FAILED ) fatal_error(-1,"cannot map vmb file: " + path + "\n") ;
+
+        vmb_read_memory((const char *)mapped,length,handler,context) ;
+
+        munmap(mapped,length) ;
+    }
+}
@@ -0,0 +1,126 @@
+// flat VM command values shared by the readers and the translator
+#include "iobuffer.h"
+#include "vm-commands.h"
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+
+namespace Hack_Virtual_Machine
+{
+    // spellings indexed by vm_opcode and vm_segment
+    static const char *opcode_names[] =
+    {
+        "add", "and", "eq", "gt", "lt", "neg", "not", "or", "sub", "return",
+        "goto", "if-goto", "label",
+        "call", "function",
+        "push", "pop",
+        "oops"
+    } ;
+    static const char *segment_names[] =
+    {
+        "argument", "constant", "local", "pointer", "static", "temp", "that", "this",
+        ""
+    } ;
+
+    bool vm_is_operator(vm_opcode op)
+    {
+        return op >= vm_add && op <= vm_return ;
+    }
+    bool vm_is_jump(vm_opcode op)
+    {
+        return op >= vm_goto && op <= vm_label ;
+    }
+    bool vm_is_function(vm_opcode op)
+    {
+        return op == vm_call || op == vm_function ;
+    }
+    bool vm_is_stack(vm_opcode op)
+    {
+        return op == vm_push || op == vm_pop ;
+    }
+
+    string vm_opcode_to_string(vm_opcode op)
+    {
+        if ( op < vm_add || op > vm_oops ) op = vm_oops ;
+        return opcode_names[op] ;
+    }
+    vm_opcode string_to_vm_opcode(string s)
+    {
+        for ( int op = vm_add ; op < vm_oops ; op++ )
+        {
+            if ( s == opcode_names[op] ) return (vm_opcode)op ;
+        }
+        return vm_oops ;
+    }
+    string vm_segment_to_string(vm_segment segment)
+    {
+        if ( segment < vm_argument || segment > vm_no_segment ) segment = vm_no_segment ;
+        return segment_names[segment] ;
+    }
+    vm_segment string_to_vm_segment(string s)
+    {
+        for ( int segment = vm_argument ; segment < vm_no_segment ; segment++ )
+        {
+            if ( s == segment_names[segment] ) return (vm_segment)segment ;
+        }
+        return vm_no_segment ;
+    }
+
+    string vm_command_to_string(const vm_command &command)
+    {
+        string text = vm_opcode_to_string(command.op) ;
+        if ( vm_is_jump(command.op) ) return text + " " + command.label ;
+        if ( vm_is_function(command.op) ) return text + " " + command.label + " " + to_string(command.number) ;
+        if ( vm_is_stack(command.op) ) return text + " " + vm_segment_to_string(command.segment) + " " + to_string(command.number) ;
+        return text ;
+    }
+
+    vm_command vm_command_from_ast(ast node)
+    {
+        vm_command command ;
+        command.segment = vm_no_segment ;
+        command.number = 0 ;
+        command.index = -1 ;
+
+        switch(ast_node_kind(node))
+        {
+        case ast_vm_operator:
+            command.op = string_to_vm_opcode(get_vm_operator_command(node)) ;
+            break ;
+        case ast_vm_jump:
+            command.op = string_to_vm_opcode(get_vm_jump_command(node)) ;
+            command.label = get_vm_jump_label(node) ;
+            break ;
+        case ast_vm_function:
+            command.op = string_to_vm_opcode(get_vm_function_command(node)) ;
+            command.label = get_vm_function_label(node) ;
+            command.number = get_vm_function_number(node) ;
+            break ;
+        case ast_vm_stack:
+            command.op = string_to_vm_opcode(get_vm_stack_command(node)) ;
+            command.segment = string_to_vm_segment(get_vm_stack_segment(node)) ;
+            command.number = get_vm_stack_offset(node) ;
+            break ;
+        default:
+            fatal_error(0,"// bad node - expected vm_operator, vm_jump, vm_function or vm_stack\n") ;
+            break ;
+        }
+        return command ;
+    }
+
+    vector<vm_command> vm_commands_from_ast(ast root)
+    {
+        ast_mustbe_kind(root,ast_vm_class) ;
+
+        vector<vm_command> commands ;
+        int ncommands = size_of_vm_class(root) ;
+        for ( int i = 0 ; i < ncommands ; i++ )
+        {
+            commands.push_back(vm_command_from_ast(get_vm_class(root,i))) ;
+            commands.back().index = i ;
+        }
+        return commands ;
+    }
+}
@@ -0,0 +1,58 @@
+// convert between Pxml documents and the compact .vmb command stream
+#include "iobuffer.h"
+#include "vm-commands.h"
+#include "vm-reader.h"
+#include "vm-binary.h"
+#include <stdio.h>
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+using namespace Hack_Virtual_Machine ;
+
+// the readers call this for every command, context is the vector to append to
+static void collect_command(const vm_command &command,void *context)
+{
+    ((vector<vm_command> *)context)->push_back(command) ;
+}
+
+static bool ends_with(string s,string suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(),suffix.size(),suffix) == 0 ;
+}
+
+static void write_text_file(string path,string text)
+{
+    FILE *file = fopen(path.c_str(),"w") ;
+    if ( file == 0 ) fatal_error(-1,"cannot create file: " + path + "\n") ;
+    size_t written = fwrite(text.data(),1,text.size(),file) ;
+    if ( fclose(file) != 0 || written != text.size() ) fatal_error(-1,"cannot write file: " + path + "\n") ;
+}
+
+// main program
+// vm-convert <file.Pxml> <file.vmb> - converts Pxml to the binary command stream
+// vm-convert <file.vmb> <file.Pxml> - converts the binary command stream back to Pxml
+int main(int argc,char **argv)
+{
+    if ( argc != 3 ) fatal_error(-1,"usage: vm-convert <input.Pxml|input.vmb> <output>\n") ;
+
+    string input = argv[1] ;
+    string output = argv[2] ;
+    vector<vm_command> commands ;
+
+    if ( ends_with(input,".vmb") )
+    {
+        vmb_read_file(input,collect_command,&commands) ;
+        write_text_file(output,pxml_encode(commands)) ;
+    }
+    else
+    {
+        pxml_read_file(input,collect_command,&commands,0) ;
+        vmb_write_file(output,commands) ;
+    }
+
+    // flush output and errors
+    print_output() ;
+    print_errors() ;
+}
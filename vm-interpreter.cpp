@@ -0,0 +1,682 @@
+// a direct threaded reference interpreter for VM programs
+#include "iobuffer.h"
+#include "symbols.h"
+#include "vm-commands.h"
+#include "vm-reader.h"
+#include "vm-binary.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+using namespace CS_Symbol_Tables ;
+using namespace Hack_Virtual_Machine ;
+
+// Interpreter
+// every class named on the command line is read into one command list and then pre-decoded into a compact instruction array
+// - each push and pop is specialised by segment, static, temp and pointer are resolved to a RAM address
+// - goto, if-goto and call hold the index of their target instruction, resolved once before running
+// - a call of a function that no class defines must be one of the built in OS functions below
+// - dispatch uses labels as values, each instruction holds the address of the code that executes it
+// - every instruction counts its own executions, so per function counts and a translator profile cost nothing extra
+//
+// the machine follows the standard VM mapping, RAM[0..4] are SP, LCL, ARG, THIS and THAT, temp is RAM[5..12],
+// statics are allocated from RAM[16] in order of first use, the stack starts at RAM[256] and the heap at RAM[2048]
+// all RAM addresses are taken modulo 32768 so a bad program cannot reach outside the machine
+//
+// all errors will result in calls to fatal_error()
+
+// the pre-decoded instructions
+enum interp_op
+{
+    i_add, i_and, i_eq, i_gt, i_lt, i_neg, i_not, i_or, i_sub, i_return,
+    i_goto, i_if_goto, i_label,
+    i_call, i_call_os, i_function,
+    i_push_constant, i_push_argument, i_push_local, i_push_this, i_push_that, i_push_ram,
+    i_pop_argument, i_pop_local, i_pop_this, i_pop_that, i_pop_ram,
+    i_halt,
+
+    i_count
+} ;
+
+struct interp_instruction
+{
+    void *handler ;             // set just before running, the code for op
+    interp_op op ;
+    int operand ;               // constant, segment offset, RAM address, number of arguments or locals
+    int target ;                // instruction index of a jump or call, the OS function of i_call_os
+    int function ;              // the index in functions of the enclosing function
+    long long count ;           // the number of times this instruction was executed
+} ;
+
+// an interpreted function, entry is the index of its function instruction
+struct interp_function
+{
+    string name ;
+    int entry ;
+} ;
+
+static vector<vm_command> commands ;
+static vector<interp_instruction> code ;
+static vector<interp_function> functions ;
+static vector<string> labels ;              // the full Class.func$label name of each i_label, indexed by operand
+
+// the machine
+#define RAM_SIZE 32768
+#define RAM_MASK 0x7fff
+#define STACK_BASE 256
+#define HEAP_BASE 2048
+#define HEAP_LIMIT 16384
+#define STATIC_BASE 16
+#define STATIC_LIMIT 256
+static short ram[RAM_SIZE] ;
+static int heap_next = HEAP_BASE ;
+static int next_static = STATIC_BASE ;
+static bool halted = false ;
+static int keys_pressed = 0 ;
+
+// the readers call this for every command
+static void collect_command(const vm_command &command,void *)
+{
+    commands.push_back(command) ;
+}
+
+static bool ends_with(string s,string suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(),suffix.size(),suffix) == 0 ;
+}
+
+/*****************   BUILT IN OS   ******************/
+
+// strings are length, capacity, characters
+// the keyboard only reads standard input, the screen is not drawn
+// Keyboard.keyPressed cannot see standard input, it returns a fixed repeating sequence of keys and no key
+// Memory.deAlloc and the dispose functions do nothing, the heap is never reused
+// Math.divide of -32768 by -1 overflows to -32768 as 16 bit arithmetic would, division by zero is an error
+enum os_function
+{
+    os_math_init, os_math_multiply, os_math_divide, os_math_min, os_math_max, os_math_abs, os_math_sqrt,
+    os_memory_init, os_memory_alloc, os_memory_dealloc, os_memory_peek, os_memory_poke,
+    os_array_new, os_array_dispose,
+    os_string_new, os_string_dispose, os_string_length, os_string_char_at, os_string_set_char_at,
+    os_string_append_char, os_string_erase_last_char, os_string_int_value, os_string_set_int,
+    os_string_back_space, os_string_double_quote, os_string_new_line,
+    os_output_init, os_output_move_cursor, os_output_print_char, os_output_print_string,
+    os_output_print_int, os_output_println, os_output_back_space,
+    os_screen_init, os_screen_clear_screen, os_screen_set_color, os_screen_draw_pixel,
+    os_screen_draw_line, os_screen_draw_rectangle, os_screen_draw_circle,
+    os_keyboard_init, os_keyboard_key_pressed, os_keyboard_read_char, os_keyboard_read_line, os_keyboard_read_int,
+    os_sys_halt, os_sys_error, os_sys_wait
+} ;
+
+struct os_entry
+{
+    const char *name ;
+    int arguments ;
+    os_function function ;
+} ;
+
+static const os_entry os_functions[] =
+{
+    { "Math.init", 0, os_math_init },
+    { "Math.multiply", 2, os_math_multiply },
+    { "Math.divide", 2, os_math_divide },
+    { "Math.min", 2, os_math_min },
+    { "Math.max", 2, os_math_max },
+    { "Math.abs", 1, os_math_abs },
+    { "Math.sqrt", 1, os_math_sqrt },
+    { "Memory.init", 0, os_memory_init },
+    { "Memory.alloc", 1, os_memory_alloc },
+    { "Memory.deAlloc", 1, os_memory_dealloc },
+    { "Memory.peek", 1, os_memory_peek },
+    { "Memory.poke", 2, os_memory_poke },
+    { "Array.new", 1, os_array_new },
+    { "Array.dispose", 1, os_array_dispose },
+    { "String.new", 1, os_string_new },
+    { "String.dispose", 1, os_string_dispose },
+    { "String.length", 1, os_string_length },
+    { "String.charAt", 2, os_string_char_at },
+    { "String.setCharAt", 3, os_string_set_char_at },
+    { "String.appendChar", 2, os_string_append_char },
+    { "String.eraseLastChar", 1, os_string_erase_last_char },
+    { "String.intValue", 1, os_string_int_value },
+    { "String.setInt", 2, os_string_set_int },
+    { "String.backSpace", 0, os_string_back_space },
+    { "String.doubleQuote", 0, os_string_double_quote },
+    { "String.newLine", 0, os_string_new_line },
+    { "Output.init", 0, os_output_init },
+    { "Output.moveCursor", 2, os_output_move_cursor },
+    { "Output.printChar", 1, os_output_print_char },
+    { "Output.printString", 1, os_output_print_string },
+    { "Output.printInt", 1, os_output_print_int },
+    { "Output.println", 0, os_output_println },
+    { "Output.backSpace", 0, os_output_back_space },
+    { "Screen.init", 0, os_screen_init },
+    { "Screen.clearScreen", 0, os_screen_clear_screen },
+    { "Screen.setColor", 1, os_screen_set_color },
+    { "Screen.drawPixel", 2, os_screen_draw_pixel },
+    { "Screen.drawLine", 4, os_screen_draw_line },
+    { "Screen.drawRectangle", 4, os_screen_draw_rectangle },
+    { "Screen.drawCircle", 3, os_screen_draw_circle },
+    { "Keyboard.init", 0, os_keyboard_init },
+    { "Keyboard.keyPressed", 0, os_keyboard_key_pressed },
+    { "Keyboard.readChar", 0, os_keyboard_read_char },
+    { "Keyboard.readLine", 1, os_keyboard_read_line },
+    { "Keyboard.readInt", 1, os_keyboard_read_int },
+    { "Sys.halt", 0, os_sys_halt },
+    { "Sys.error", 1, os_sys_error },
+    { "Sys.wait", 1, os_sys_wait },
+} ;
+#define OS_FUNCTIONS (int)(sizeof(os_functions) / sizeof(os_functions[0]))
+
+static short &ram_at(int address)
+{
+    return ram[address & RAM_MASK] ;
+}
+
+static int os_alloc(int size)
+{
+    int block = heap_next ;
+    heap_next += max(1,size) ;
+    if ( heap_next > HEAP_LIMIT ) fatal_error(-1,"heap overflow allocating " + to_string(size) + " words\n") ;
+    return block ;
+}
+
+static int os_new_string(int capacity)
+{
+    int s = os_alloc(capacity + 2) ;
+    ram_at(s) = 0 ;
+    ram_at(s + 1) = capacity ;
+    return s ;
+}
+
+static void os_print_string(int s)
+{
+    string text ;
+    for ( int i = 0 ; i < ram_at(s) ; i++ ) text += (char)ram_at(s + 2 + i) ;
+    write_to_output(text) ;
+}
+
+static string os_read_line()
+{
+    string line ;
+    for ( int c ; (c = getchar()) != EOF && c != '\n' ; ) line += (char)c ;
+    return line ;
+}
+
+static int os_string_from(string text)
+{
+    int s = os_new_string(text.size()) ;
+    for ( size_t i = 0 ; i < text.size() ; i++ ) ram_at(s + 2 + i) = text[i] ;
+    ram_at(s) = text.size() ;
+    return s ;
+}
+
+// a is the first argument on the stack, the result replaces the arguments
+static int call_os(int id,short *a)
+{
+    switch(os_functions[id].function)
+    {
+    case os_math_multiply:          return a[0] * a[1] ;
+    case os_math_divide:
+        if ( a[1] == 0 ) fatal_error(-1,"Math.divide: division by zero\n") ;
+        if ( a[0] == -32768 && a[1] == -1 ) return -32768 ;
+        return a[0] / a[1] ;
+    case os_math_min:               return min(a[0],a[1]) ;
+    case os_math_max:               return max(a[0],a[1]) ;
+    case os_math_abs:               return a[0] < 0 ? -a[0] : a[0] ;
+    case os_math_sqrt:
+    {
+        int root = 0 ;
+        while ( (root + 1) * (root + 1) <= a[0] ) root++ ;
+        return root ;
+    }
+    case os_memory_alloc:
+    case os_array_new:              return os_alloc(a[0]) ;
+    case os_memory_peek:            return ram_at(a[0]) ;
+    case os_memory_poke:            ram_at(a[0]) = a[1] ; return 0 ;
+    case os_string_new:             return os_new_string(a[0]) ;
+    case os_string_length:          return ram_at(a[0]) ;
+    case os_string_char_at:         return ram_at(a[0] + 2 + a[1]) ;
+    case os_string_set_char_at:     ram_at(a[0] + 2 + a[1]) = a[2] ; return 0 ;
+    case os_string_append_char:
+        if ( ram_at(a[0]) < ram_at(a[0] + 1) ) ram_at(a[0] + 2 + ram_at(a[0])++) = a[1] ;
+        return a[0] ;
+    case os_string_erase_last_char:
+        if ( ram_at(a[0]) > 0 ) ram_at(a[0])-- ;
+        return 0 ;
+    case os_string_int_value:
+    {
+        string text ;
+        for ( int i = 0 ; i < ram_at(a[0]) ; i++ ) text += (char)ram_at(a[0] + 2 + i) ;
+        return atoi(text.c_str()) ;
+    }
+    case os_string_set_int:
+    {
+        string text = to_string(a[1]) ;
+        int length = min((int)text.size(),(int)ram_at(a[0] + 1)) ;
+        for ( int i = 0 ; i < length ; i++ ) ram_at(a[0] + 2 + i) = text[i] ;
+        ram_at(a[0]) = length ;
+        return 0 ;
+    }
+    case os_string_back_space:      return 129 ;
+    case os_string_double_quote:    return 34 ;
+    case os_string_new_line:        return 128 ;
+    case os_output_print_char:      write_to_output(string(1,a[0] == 128 ? '\n' : (char)a[0])) ; return 0 ;
+    case os_output_print_string:    os_print_string(a[0]) ; return 0 ;
+    case os_output_print_int:       write_to_output(to_string(a[0])) ; return 0 ;
+    case os_output_println:         write_to_output("\n") ; return 0 ;
+    case os_screen_clear_screen:
+        for ( int i = 16384 ; i < 24576 ; i++ ) ram[i] = 0 ;
+        return 0 ;
+    case os_keyboard_key_pressed:
+    {
+        static const int keys[] = { 0, 0, 130, 0, 132, 140, 0, 81 } ;
+        return keys[++keys_pressed % 8] ;
+    }
+    case os_keyboard_read_char:
+    {
+        int c = getchar() ;
+        return c == EOF ? 0 : c == '\n' ? 128 : c ;
+    }
+    case os_keyboard_read_line:
+        os_print_string(a[0]) ;
+        return os_string_from(os_read_line()) ;
+    case os_keyboard_read_int:
+        os_print_string(a[0]) ;
+        return atoi(os_read_line().c_str()) ;
+    case os_sys_halt:
+        halted = true ;
+        return 0 ;
+    case os_sys_error:
+        fatal_error(-1,"Sys.error: ERR" + to_string(a[0]) + "\n") ;
+        return 0 ;
+    default:                        return 0 ;
+    }
+}
+
+/*****************   DECODING   ******************/
+
+static string class_of(string function)
+{
+    return function.substr(0,function.find('.')) ;
+}
+
+// give every function an index and every label an instruction index, labels are keyed Class.func$label
+static void find_targets(symbols function_ids,symbols label_targets)
+{
+    string function = "" ;
+    for ( size_t i = 0 ; i < commands.size() ; i++ )
+    {
+        const vm_command &command = commands[i] ;
+        if ( command.op == vm_function )
+        {
+            function = command.label ;
+            interp_function f = { function, (int)i } ;
+            if ( !insert_ints(function_ids,function,functions.size()) ) fatal_error(-1,"function " + function + " is defined more than once\n") ;
+            functions.push_back(f) ;
+        }
+        else if ( command.op == vm_label )
+        {
+            if ( function == "" ) fatal_error(-1,"label " + command.label + " is not inside a function\n") ;
+            if ( !insert_ints(label_targets,function + "$" + command.label,i) )
+            {
+                fatal_error(-1,"function " + function + ": label " + command.label + " is defined more than once\n") ;
+            }
+        }
+    }
+}
+
+static int os_function_id(string name,int arguments)
+{
+    for ( int id = 0 ; id < OS_FUNCTIONS ; id++ )
+    {
+        if ( name == os_functions[id].name && arguments == os_functions[id].arguments ) return id ;
+    }
+    return -1 ;
+}
+
+// statics are given RAM addresses in order of first use, as the assembler does
+static int static_address(symbols statics,string name)
+{
+    int address = lookup_ints(statics,name) ;
+    if ( address >= 0 ) return address ;
+    if ( next_static >= STATIC_LIMIT ) fatal_error(-1,"too many static variables\n") ;
+    insert_ints(statics,name,next_static) ;
+    return next_static++ ;
+}
+
+static void decode(string entry)
+{
+    symbols function_ids = create_ints() ;
+    symbols label_targets = create_ints() ;
+    symbols statics = create_ints() ;
+    find_targets(function_ids,label_targets) ;
+
+    string function = "" ;
+    int function_index = -1 ;
+    for ( size_t i = 0 ; i < commands.size() ; i++ )
+    {
+        const vm_command &command = commands[i] ;
+        interp_instruction instruction = { 0, i_halt, command.number, -1, function_index, 0 } ;
+
+        switch(command.op)
+        {
+        case vm_goto:
+        case vm_if_goto:
+            instruction.op = command.op == vm_goto ? i_goto : i_if_goto ;
+            instruction.target = lookup_ints(label_targets,function + "$" + command.label) ;
+            if ( instruction.target < 0 ) fatal_error(-1,"function " + function + ": jump to undefined label " + command.label + "\n") ;
+            break ;
+        case vm_label:
+            instruction.op = i_label ;
+            instruction.operand = labels.size() ;
+            labels.push_back(function + "$" + command.label) ;
+            break ;
+        case vm_function:
+            function = command.label ;
+            function_index = lookup_ints(function_ids,function) ;
+            instruction.op = i_function ;
+            instruction.function = function_index ;
+            break ;
+        case vm_call:
+            instruction.op = i_call ;
+            instruction.target = lookup_ints(function_ids,command.label) ;
+            if ( instruction.target >= 0 )
+            {
+                instruction.target = functions[instruction.target].entry ;
+            }
+            else
+            {
+                instruction.op = i_call_os ;
+                instruction.target = os_function_id(command.label,command.number) ;
+                if ( instruction.target < 0 ) fatal_error(-1,"call of undefined function " + command.label + " " + to_string(command.number) + "\n") ;
+            }
+            break ;
+        case vm_push:
+        case vm_pop:
+        {
+            bool push = command.op == vm_push ;
+            switch(command.segment)
+            {
+            case vm_constant:
+                if ( !push ) fatal_error(-1,"pop constant is not allowed\n") ;
+                instruction.op = i_push_constant ;
+                break ;
+            case vm_argument:   instruction.op = push ? i_push_argument : i_pop_argument ;  break ;
+            case vm_local:      instruction.op = push ? i_push_local : i_pop_local ;        break ;
+            case vm_this:       instruction.op = push ? i_push_this : i_pop_this ;          break ;
+            case vm_that:       instruction.op = push ? i_push_that : i_pop_that ;          break ;
+            case vm_temp:
+            case vm_pointer:
+            case vm_static:
+                instruction.op = push ? i_push_ram : i_pop_ram ;
+                if ( command.segment == vm_temp ) instruction.operand = 5 + command.number ;
+                else if ( command.segment == vm_pointer ) instruction.operand = 3 + command.number ;
+                else instruction.operand = static_address(statics,class_of(function) + "." + to_string(command.number)) ;
+                break ;
+            default:
+                fatal_error(-1,"bad segment in " + vm_command_to_string(command) + "\n") ;
+                break ;
+            }
+            break ;
+        }
+        default:
+            // the operators are in the same order in both enumerations
+            instruction.op = (interp_op)(i_add + (command.op - vm_add)) ;
+            break ;
+        }
+        code.push_back(instruction) ;
+    }
+
+    // the program is started by call entry 0 followed by halt
+    int entry_index = lookup_ints(function_ids,entry) ;
+    if ( entry_index < 0 ) fatal_error(-1,"the entry function " + entry + " is not defined\n") ;
+    interp_instruction start = { 0, i_call, 0, functions[entry_index].entry, -1, 0 } ;
+    interp_instruction stop = { 0, i_halt, 0, -1, -1, 0 } ;
+    code.push_back(start) ;
+    code.push_back(stop) ;
+
+    // return addresses are stored in RAM
+    if ( code.size() > 65535 ) fatal_error(-1,"program is too large to interpret: " + to_string(code.size()) + " instructions\n") ;
+
+    delete_ints(statics) ;
+    delete_ints(label_targets) ;
+    delete_ints(function_ids) ;
+}
+
+/*****************   EXECUTION   ******************/
+
+// run from the start instruction for at most max_steps instructions, returns the number executed
+static long long run(long long max_steps)
+{
+    static void *handlers[i_count] =
+    {
+        &&do_add, &&do_and, &&do_eq, &&do_gt, &&do_lt, &&do_neg, &&do_not, &&do_or, &&do_sub, &&do_return,
+        &&do_goto, &&do_if_goto, &&do_label,
+        &&do_call, &&do_call_os, &&do_function,
+        &&do_push_constant, &&do_push_argument, &&do_push_local, &&do_push_this, &&do_push_that, &&do_push_ram,
+        &&do_pop_argument, &&do_pop_local, &&do_pop_this, &&do_pop_that, &&do_pop_ram,
+        &&do_halt
+    } ;
+    for ( size_t i = 0 ; i < code.size() ; i++ ) code[i].handler = handlers[code[i].op] ;
+
+    interp_instruction *const base = &code[0] ;
+    interp_instruction *ip = base + code.size() - 2 ;
+    long long budget = max_steps ;
+    int sp = STACK_BASE ;
+    int y ;
+
+    #define RAM(address) ram[(address) & RAM_MASK]
+    #define DISPATCH() do { if ( --budget < 0 ) goto out_of_steps ; ip->count++ ; goto *ip->handler ; } while (0)
+    #define NEXT() do { ip++ ; DISPATCH() ; } while (0)
+    #define BINARY(expression) y = RAM(--sp) ; RAM(sp - 1) = (expression) ; NEXT()
+
+    DISPATCH() ;
+
+do_add:     BINARY(RAM(sp - 1) + y) ;
+do_sub:     BINARY(RAM(sp - 1) - y) ;
+do_and:     BINARY(RAM(sp - 1) & y) ;
+do_or:      BINARY(RAM(sp - 1) | y) ;
+do_eq:      BINARY(RAM(sp - 1) == y ? -1 : 0) ;
+do_gt:      BINARY(RAM(sp - 1) > y ? -1 : 0) ;
+do_lt:      BINARY(RAM(sp - 1) < y ? -1 : 0) ;
+do_neg:     RAM(sp - 1) = -RAM(sp - 1) ; NEXT() ;
+do_not:     RAM(sp - 1) = ~RAM(sp - 1) ; NEXT() ;
+
+do_label:   NEXT() ;
+do_goto:    ip = base + ip->target ; DISPATCH() ;
+do_if_goto: ip = RAM(--sp) != 0 ? base + ip->target : ip + 1 ; DISPATCH() ;
+
+do_call:
+    RAM(sp) = (short)(ip - base + 1) ;
+    RAM(sp + 1) = ram[1] ;
+    RAM(sp + 2) = ram[2] ;
+    RAM(sp + 3) = ram[3] ;
+    RAM(sp + 4) = ram[4] ;
+    sp += 5 ;
+    ram[2] = sp - 5 - ip->operand ;
+    ram[1] = sp ;
+    ip = base + ip->target ;
+    DISPATCH() ;
+do_call_os:
+    ram[0] = sp ;
+    sp -= ip->operand ;
+    y = call_os(ip->target,&RAM(sp)) ;
+    RAM(sp++) = y ;
+    if ( halted ) goto done ;
+    NEXT() ;
+do_function:
+    for ( int i = 0 ; i < ip->operand ; i++ ) RAM(sp++) = 0 ;
+    NEXT() ;
+do_return:
+{
+    int frame = (unsigned short)ram[1] ;
+    int ret = (unsigned short)RAM(frame - 5) ;
+    RAM(ram[2]) = RAM(sp - 1) ;
+    sp = (unsigned short)ram[2] + 1 ;
+    ram[4] = RAM(frame - 1) ;
+    ram[3] = RAM(frame - 2) ;
+    ram[2] = RAM(frame - 3) ;
+    ram[1] = RAM(frame - 4) ;
+    if ( ret >= (int)code.size() ) fatal_error(-1,"return to a bad address: " + to_string(ret) + "\n") ;
+    ip = base + ret ;
+    DISPATCH() ;
+}
+
+do_push_constant:   RAM(sp++) = ip->operand ; NEXT() ;
+do_push_argument:   RAM(sp++) = RAM(ram[2] + ip->operand) ; NEXT() ;
+do_push_local:      RAM(sp++) = RAM(ram[1] + ip->operand) ; NEXT() ;
+do_push_this:       RAM(sp++) = RAM(ram[3] + ip->operand) ; NEXT() ;
+do_push_that:       RAM(sp++) = RAM(ram[4] + ip->operand) ; NEXT() ;
+do_push_ram:        RAM(sp++) = ram[ip->operand] ; NEXT() ;
+do_pop_argument:    RAM(ram[2] + ip->operand) = RAM(--sp) ; NEXT() ;
+do_pop_local:       RAM(ram[1] + ip->operand) = RAM(--sp) ; NEXT() ;
+do_pop_this:        RAM(ram[3] + ip->operand) = RAM(--sp) ; NEXT() ;
+do_pop_that:        RAM(ram[4] + ip->operand) = RAM(--sp) ; NEXT() ;
+do_pop_ram:         ram[ip->operand] = RAM(--sp) ; NEXT() ;
+
+do_halt:
+done:
+    ram[0] = sp ;
+    return max_steps - max(0LL,budget) ;
+out_of_steps:
+    ram[0] = sp ;
+    write_to_errors("stopped after " + to_string(max_steps) + " instructions\n") ;
+    return max_steps ;
+
+    #undef BINARY
+    #undef NEXT
+    #undef DISPATCH
+    #undef RAM
+}
+
+/*****************   REPORTS   ******************/
+
+struct function_counts
+{
+    long long instructions ;
+    long long calls ;
+    int function ;
+} ;
+
+static bool more_instructions(const function_counts &a,const function_counts &b)
+{
+    return a.instructions > b.instructions ;
+}
+
+// one line per function that was called, most instructions first
+static void report_counts(long long steps)
+{
+    vector<function_counts> counts(functions.size()) ;
+    for ( size_t f = 0 ; f < functions.size() ; f++ )
+    {
+        counts[f].instructions = 0 ;
+        counts[f].calls = code[functions[f].entry].count ;
+        counts[f].function = f ;
+    }
+    for ( size_t i = 0 ; i < code.size() ; i++ )
+    {
+        if ( code[i].function >= 0 ) counts[code[i].function].instructions += code[i].count ;
+    }
+    stable_sort(counts.begin(),counts.end(),more_instructions) ;
+
+    write_to_errors("instructions        calls  function\n") ;
+    for ( size_t f = 0 ; f < counts.size() && counts[f].calls > 0 ; f++ )
+    {
+        char line[64] ;
+        snprintf(line,sizeof(line),"%12lld %12lld  ",counts[f].instructions,counts[f].calls) ;
+        write_to_errors(line + functions[counts[f].function].name + "\n") ;
+    }
+    write_to_errors("total " + to_string(steps) + " instructions\n") ;
+}
+
+// the execution counts in the format read by translator --profile=<file>
+static void write_profile(string path)
+{
+    ofstream file(path.c_str()) ;
+    file << "# vm-interpreter profile: <key> <count>" << endl ;
+    for ( size_t f = 0 ; f < functions.size() ; f++ )
+    {
+        file << functions[f].name << " " << code[functions[f].entry].count << endl ;
+    }
+    for ( size_t i = 0 ; i < code.size() ; i++ )
+    {
+        if ( code[i].op == i_label && code[i].count > 0 ) file << labels[code[i].operand] << " " << code[i].count << endl ;
+    }
+    if ( !file ) fatal_error(-1,"cannot write profile: " + path + "\n") ;
+}
+
+// main program
+// vm-interpreter [--entry=<Class.func>] [--steps=<n>] [--profile=<file>] <file.Pxml|file.vmb>...
+// runs the classes from Sys.init, or Main.main if there is no Sys.init, until the entry function returns,
+// Sys.halt is called or n instructions have been executed, the default n is 100000000
+// per function instruction and call counts are written to standard error
+// --profile=<file> also writes the function entry and label arrival counts for translator --profile=<file>
+int main(int argc,char **argv)
+{
+    string entry = "" ;
+    string profile = "" ;
+    long long max_steps = 100000000 ;
+    vector<string> paths ;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        string arg = argv[i] ;
+        if ( arg.compare(0,8,"--entry=") == 0 )
+        {
+            entry = arg.substr(8) ;
+        }
+        else if ( arg.compare(0,8,"--steps=") == 0 )
+        {
+            max_steps = atoll(arg.substr(8).c_str()) ;
+        }
+        else if ( arg.compare(0,10,"--profile=") == 0 )
+        {
+            profile = arg.substr(10) ;
+        }
+        else if ( arg[0] == '-' )
+        {
+            fatal_error(-1,"usage: vm-interpreter [--entry=<Class.func>] [--steps=<n>] [--profile=<file>] <file.Pxml|file.vmb>...\n") ;
+        }
+        else
+        {
+            paths.push_back(arg) ;
+        }
+    }
+    if ( paths.empty() ) fatal_error(-1,"usage: vm-interpreter [--entry=<Class.func>] [--steps=<n>] [--profile=<file>] <file.Pxml|file.vmb>...\n") ;
+
+    for ( size_t i = 0 ; i < paths.size() ; i++ )
+    {
+        if ( ends_with(paths[i],".vmb") )
+        {
+            vmb_read_file(paths[i],collect_command,0) ;
+        }
+        else
+        {
+            pxml_read_file(paths[i],collect_command,0,0) ;
+        }
+    }
+
+    if ( entry == "" )
+    {
+        entry = "Main.main" ;
+        for ( size_t i = 0 ; i < commands.size() ; i++ )
+        {
+            if ( commands[i].op == vm_function && commands[i].label == "Sys.init" ) entry = "Sys.init" ;
+        }
+    }
+
+    decode(entry) ;
+    long long steps = run(max_steps) ;
+    report_counts(steps) ;
+    if ( profile != "" ) write_profile(profile) ;
+
+    // flush output and errors
+    print_output() ;
+    print_errors() ;
+}
@@ -0,0 +1,85 @@
+// interned labels of the function being translated
+#include "iobuffer.h"
+#include "symbols.h"
+#include "vm-labels.h"
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+using namespace CS_Symbol_Tables ;
+
+namespace Hack_Virtual_Machine
+{
+    // one entry per label id
+    struct vm_label_info
+    {
+        string name ;           // the Hack assembly name
+        bool defined ;          // seen in a label command
+        bool jumped_to ;        // seen in a goto or if-goto command
+    } ;
+
+    static symbols label_ids = -1 ;
+    static vector<vm_label_info> labels ;
+    static string function_name ;
+    static string label_prefix ;
+
+    void vm_labels_start_function(string function)
+    {
+        if ( label_ids != -1 ) delete_ints(label_ids) ;
+        label_ids = create_ints() ;
+        labels.clear() ;
+        function_name = function ;
+        label_prefix = function + "$" ;
+    }
+
+    void vm_labels_end_function(bool check_jumps)
+    {
+        for ( size_t id = 0 ; check_jumps && id < labels.size() ; id++ )
+        {
+            if ( labels[id].jumped_to && !labels[id].defined )
+            {
+                fatal_error(-1,"function " + function_name + ": jump to undefined label " +
+                               labels[id].name.substr(label_prefix.size()) + "\n") ;
+            }
+        }
+        if ( label_ids != -1 ) delete_ints(label_ids) ;
+        label_ids = -1 ;
+        labels.clear() ;
+    }
+
+    int vm_label_id(const string &label)
+    {
+        // commands before the first function still get a table
+        if ( label_ids == -1 ) vm_labels_start_function(VM_UNKNOWN_FUNCTION) ;
+
+        int id = lookup_ints(label_ids,label) ;
+        if ( id != -1 ) return id ;
+
+        id = labels.size() ;
+        insert_ints(label_ids,label,id) ;
+        vm_label_info info = { label_prefix + label, false, false } ;
+        labels.push_back(info) ;
+        return id ;
+    }
+
+    const string &vm_label_name(int id)
+    {
+        return labels[id].name ;
+    }
+
+    void vm_label_defined(int id)
+    {
+        if ( labels[id].defined )
+        {
+            fatal_error(-1,"function " + function_name + ": label " +
+                           labels[id].name.substr(label_prefix.size()) + " is defined more than once\n") ;
+        }
+        labels[id].defined = true ;
+    }
+
+    void vm_label_jumped_to(int id)
+    {
+        labels[id].jumped_to = true ;
+    }
+}
@@ -0,0 +1,159 @@
+// a summary of the functions of a whole program
+#include "iobuffer.h"
+#include "symbols.h"
+#include "vm-program.h"
+#include "vm-reader.h"
+#include "vm-binary.h"
+#include <fstream>
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+using namespace CS_Symbol_Tables ;
+
+namespace Hack_Virtual_Machine
+{
+    // one summary per function, in the order the functions were read
+    static symbols function_ids = -1 ;
+    static vector<vm_function_summary> functions ;
+
+    // the arguments passed by every call seen so far, -2 once two calls disagree
+    static symbols call_arguments = -1 ;
+
+    // the reader's progress through the function being summarised
+    struct program_reader
+    {
+        int function ;          // index into functions, -1 before a class's first function
+        int depth ;             // the stack depth after the last command
+    } ;
+
+    void vm_program_clear()
+    {
+        if ( function_ids != -1 ) delete_ints(function_ids) ;
+        if ( call_arguments != -1 ) delete_ints(call_arguments) ;
+        function_ids = -1 ;
+        call_arguments = -1 ;
+        functions.clear() ;
+    }
+
+    // a call passing number arguments to label
+    static void record_call(const string &label,int number)
+    {
+        int seen = lookup_ints(call_arguments,label) ;
+        if ( seen == -1 ) insert_ints(call_arguments,label,number) ;
+        else if ( seen != number ) update_ints(call_arguments,label,-2) ;
+    }
+
+    // follow the stack depth, pops is the number of values a command takes and pushes the number it leaves
+    static void follow_depth(program_reader &reader,vm_function_summary &summary,int pops,int pushes)
+    {
+        if ( reader.depth < pops ) summary.balanced = false ;
+        reader.depth += pushes - pops ;
+    }
+
+    static void summarise_command(const vm_command &command,void *context)
+    {
+        program_reader &reader = *(program_reader *)context ;
+
+        if ( command.op == vm_function )
+        {
+            vm_function_summary summary = { command.label, command.number, -1, 0, 0, false, true, false, false } ;
+            if ( !insert_ints(function_ids,command.label,functions.size()) )
+            {
+                fatal_error(-1,"program: function " + command.label + " is defined more than once\n") ;
+            }
+            reader.function = functions.size() ;
+            reader.depth = 0 ;
+            functions.push_back(summary) ;
+            return ;
+        }
+        if ( command.op == vm_call ) record_call(command.label,command.number) ;
+
+        // commands before the first function belong to no function
+        if ( reader.function < 0 ) return ;
+        vm_function_summary &summary = functions[reader.function] ;
+
+        switch ( command.op )
+        {
+        case vm_push:
+            follow_depth(reader,summary,0,1) ;
+            break ;
+        case vm_pop:
+            follow_depth(reader,summary,1,0) ;
+            if ( command.segment == vm_pointer && command.number == 0 ) summary.pops_this = true ;
+            if ( command.segment == vm_pointer && command.number == 1 ) summary.pops_that = true ;
+            break ;
+        case vm_neg: case vm_not:
+            follow_depth(reader,summary,1,1) ;
+            break ;
+        case vm_call:
+            summary.calls = true ;
+            follow_depth(reader,summary,command.number,1) ;
+            break ;
+        case vm_if_goto:
+            follow_depth(reader,summary,1,0) ;
+            if ( reader.depth != 0 ) summary.balanced = false ;
+            break ;
+        case vm_goto: case vm_label:
+            if ( reader.depth != 0 ) summary.balanced = false ;
+            break ;
+        case vm_return:
+            if ( reader.depth != 1 ) summary.balanced = false ;
+            reader.depth = 0 ;
+            break ;
+        default:
+            follow_depth(reader,summary,2,1) ;
+            break ;
+        }
+
+        if ( vm_is_stack(command.op) && command.segment == vm_argument )
+        {
+            summary.arguments_used = max(summary.arguments_used,command.number + 1) ;
+        }
+        if ( vm_is_stack(command.op) && command.segment == vm_local )
+        {
+            summary.locals_used = max(summary.locals_used,command.number + 1) ;
+        }
+    }
+
+    void vm_program_read(string path)
+    {
+        ifstream list(path.c_str()) ;
+        if ( !list ) fatal_error(-1,"cannot open program list: " + path + "\n") ;
+
+        vm_program_clear() ;
+        function_ids = create_ints() ;
+        call_arguments = create_ints() ;
+
+        string line ;
+        while ( getline(list,line) )
+        {
+            size_t start = line.find_first_not_of(" \t\r") ;
+            if ( start == string::npos || line[start] == '#' ) continue ;
+            string file = line.substr(start,line.find_last_not_of(" \t\r") + 1 - start) ;
+
+            program_reader reader = { -1, 0 } ;
+            if ( file.size() > 4 && file.compare(file.size() - 4,4,".vmb") == 0 )
+            {
+                vmb_read_file(file,summarise_command,&reader) ;
+            }
+            else
+            {
+                pxml_read_file(file,summarise_command,&reader) ;
+            }
+        }
+
+        for ( size_t i = 0 ; i < functions.size() ; i++ )
+        {
+            functions[i].arguments = lookup_ints(call_arguments,functions[i].name) ;
+        }
+    }
+
+    const vm_function_summary *vm_program_function(const string &name)
+    {
+        if ( function_ids == -1 ) return 0 ;
+        int id = lookup_ints(function_ids,name) ;
+        return id < 0 ? 0 : &functions[id] ;
+    }
+}
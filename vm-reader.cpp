@@ -0,0 +1,463 @@
+// a memory mapped, hand written scanner for Pxml documents
+#include "iobuffer.h"
+#include "vm-reader.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+
+namespace Hack_Virtual_Machine
+{
+    // the scanner state, p is the next unread character
+    // a worker thread's scanner is deferred, its errors are thrown back to the chunk's reader instead of being fatal
+    struct pxml_scanner
+    {
+        const char *p ;
+        const char *end ;
+        int line ;
+        bool deferred ;
+    } ;
+
+    struct pxml_scan_failed
+    {
+        int line ;
+        string message ;
+    } ;
+
+    static void scan_error(pxml_scanner &s,string message)
+    {
+        if ( s.deferred )
+        {
+            pxml_scan_failed failed = { s.line, message } ;
+            throw failed ;
+        }
+        fatal_error(-1,"Pxml line " + to_string(s.line) + ": " + message + "\n") ;
+    }
+
+    static void skip_space(pxml_scanner &s)
+    {
+        while ( s.p < s.end && (*s.p == ' ' || *s.p == '\t' || *s.p == '\r' || *s.p == '\n') )
+        {
+            if ( *s.p == '\n' ) s.line++ ;
+            s.p++ ;
+        }
+    }
+
+    // if the next characters are tag consume them and return true
+    static bool match(pxml_scanner &s,const char *tag,size_t length)
+    {
+        skip_space(s) ;
+        if ( (size_t)(s.end - s.p) < length || memcmp(s.p,tag,length) != 0 ) return false ;
+        s.p += length ;
+        return true ;
+    }
+
+    // tag literals with their lengths
+    #define TAG(t) t,sizeof(t)-1
+
+    static void mustbe(pxml_scanner &s,const char *tag,size_t length)
+    {
+        if ( !match(s,tag,length) ) scan_error(s,"expected " + string(tag,length)) ;
+    }
+
+    // the text of an element, returned in place, leading and trailing space is not permitted
+    static size_t text(pxml_scanner &s,const char *&start)
+    {
+        start = s.p ;
+        while ( s.p < s.end && *s.p != '<' )
+        {
+            if ( *s.p == '\n' ) s.line++ ;
+            s.p++ ;
+        }
+        return s.p - start ;
+    }
+
+    static vm_opcode text_opcode(pxml_scanner &s)
+    {
+        static const char *names[] =
+        {
+            "add", "and", "eq", "gt", "lt", "neg", "not", "or", "sub", "return",
+            "goto", "if-goto", "label", "call", "function", "push", "pop"
+        } ;
+        const char *start ;
+        size_t length = text(s,start) ;
+        for ( int op = vm_add ; op < vm_oops ; op++ )
+        {
+            if ( strlen(names[op]) == length && memcmp(names[op],start,length) == 0 ) return (vm_opcode)op ;
+        }
+        scan_error(s,"unknown command: " + string(start,length)) ;
+        return vm_oops ;
+    }
+
+    static vm_segment text_segment(pxml_scanner &s)
+    {
+        static const char *names[] =
+        {
+            "argument", "constant", "local", "pointer", "static", "temp", "that", "this"
+        } ;
+        const char *start ;
+        size_t length = text(s,start) ;
+        for ( int segment = vm_argument ; segment < vm_no_segment ; segment++ )
+        {
+            if ( strlen(names[segment]) == length && memcmp(names[segment],start,length) == 0 ) return (vm_segment)segment ;
+        }
+        scan_error(s,"unknown segment: " + string(start,length)) ;
+        return vm_no_segment ;
+    }
+
+    // a number in the range 0 to 32767
+    static int text_number(pxml_scanner &s)
+    {
+        const char *start ;
+        size_t length = text(s,start) ;
+        if ( length == 0 || length > 5 ) scan_error(s,"expected a number in the range 0 to 32767") ;
+
+        int number = 0 ;
+        for ( size_t i = 0 ; i < length ; i++ )
+        {
+            if ( start[i] < '0' || start[i] > '9' ) scan_error(s,"expected a number in the range 0 to 32767") ;
+            number = number * 10 + start[i] - '0' ;
+        }
+        if ( number > 32767 ) scan_error(s,"expected a number in the range 0 to 32767") ;
+        return number ;
+    }
+
+    static void element_command(pxml_scanner &s,vm_command &command,bool (*grouping)(vm_opcode))
+    {
+        mustbe(s,TAG("<command>")) ;
+        command.op = text_opcode(s) ;
+        if ( !grouping(command.op) ) scan_error(s,"command " + vm_opcode_to_string(command.op) + " does not belong here") ;
+        mustbe(s,TAG("</command>")) ;
+    }
+
+    static void element_label(pxml_scanner &s,vm_command &command)
+    {
+        const char *start ;
+        mustbe(s,TAG("<label>")) ;
+        size_t length = text(s,start) ;
+        if ( length == 0 ) scan_error(s,"expected a label") ;
+        command.label.assign(start,length) ;
+        mustbe(s,TAG("</label>")) ;
+    }
+
+    // scan commands until </vm-class>, or until the end of a chunk that is not the last
+    static void scan_commands(pxml_scanner &s,bool last,vm_command_handler handler,void *context)
+    {
+        vm_command command ;
+        command.index = 0 ;
+
+        for (;;)
+        {
+            skip_space(s) ;
+            if ( !last && s.p == s.end ) return ;
+            if ( match(s,TAG("</vm-class>")) ) break ;
+
+            command.segment = vm_no_segment ;
+            command.number = 0 ;
+            command.label.clear() ;
+
+            if ( match(s,TAG("<vm-operator>")) )
+            {
+                element_command(s,command,vm_is_operator) ;
+                mustbe(s,TAG("</vm-operator>")) ;
+            }
+            else
+            if ( match(s,TAG("<vm-jump>")) )
+            {
+                element_command(s,command,vm_is_jump) ;
+                element_label(s,command) ;
+                mustbe(s,TAG("</vm-jump>")) ;
+            }
+            else
+            if ( match(s,TAG("<vm-function>")) )
+            {
+                element_command(s,command,vm_is_function) ;
+                element_label(s,command) ;
+                mustbe(s,TAG("<number>")) ;
+                command.number = text_number(s) ;
+                mustbe(s,TAG("</number>")) ;
+                mustbe(s,TAG("</vm-function>")) ;
+            }
+            else
+            if ( match(s,TAG("<vm-stack>")) )
+            {
+                element_command(s,command,vm_is_stack) ;
+                mustbe(s,TAG("<segment>")) ;
+                command.segment = text_segment(s) ;
+                mustbe(s,TAG("</segment>")) ;
+                mustbe(s,TAG("<offset>")) ;
+                command.number = text_number(s) ;
+                mustbe(s,TAG("</offset>")) ;
+                mustbe(s,TAG("</vm-stack>")) ;
+            }
+            else
+            {
+                scan_error(s,"expected <vm-operator>, <vm-jump>, <vm-function>, <vm-stack> or </vm-class>") ;
+            }
+
+            handler(command,context) ;
+            command.index++ ;
+        }
+        skip_space(s) ;
+        if ( s.p != s.end ) scan_error(s,"unexpected text after </vm-class>") ;
+    }
+
+    static void scan_class(pxml_scanner &s,bool last,vm_command_handler handler,void *context)
+    {
+        if ( match(s,TAG("<vm-class/>")) ) return ;
+        mustbe(s,TAG("<vm-class>")) ;
+        scan_commands(s,last,handler,context) ;
+    }
+
+    // parallel scanning
+    // a pre-scan splits the document into chunks of at least PXML_CHUNK_SIZE bytes that start at a <vm-function> tag,
+    // that element wraps function, call and return commands so a chunk starts at a command, not necessarily at a function,
+    // which is all the scanner needs because no command depends on the one before it
+    // labels cannot contain '<' so every match is a tag, the first chunk starts with <vm-class> and the last ends the document
+    // worker threads scan the chunks into command lists, at most PXML_CHUNK_WINDOW chunks per thread ahead of the handler
+    // the handler is called on the calling thread in document order with the same command indexes as a serial scan
+    // a worker's error is reported when its chunk is reached, after every command before it has been handled,
+    // with the line number counted from the start of the document, so the results never depend on the number of threads
+    #define PXML_PARALLEL_MINIMUM (1 << 20)
+    #define PXML_CHUNK_SIZE (64 << 10)
+    #define PXML_CHUNK_WINDOW 4
+
+    struct pxml_chunk
+    {
+        const char *start ;
+        const char *end ;
+        vector<vm_command> commands ;
+        int lines ;                     // newlines in the chunk, or before the error
+        bool failed ;
+        pxml_scan_failed error ;
+        bool done ;
+    } ;
+
+    struct pxml_work
+    {
+        vector<pxml_chunk> chunks ;
+        size_t next ;                   // the next chunk a worker will take
+        size_t handled ;                // the chunks already passed to the handler
+        size_t window ;
+        mutex lock ;
+        condition_variable chunk_done ;
+        condition_variable chunk_handled ;
+    } ;
+
+    static void collect_command(const vm_command &command,void *context)
+    {
+        ((vector<vm_command> *)context)->push_back(command) ;
+    }
+
+    static void scan_chunk(pxml_chunk &chunk,bool first,bool last)
+    {
+        pxml_scanner s ;
+        s.p = chunk.start ;
+        s.end = chunk.end ;
+        s.line = 1 ;
+        s.deferred = true ;
+        try
+        {
+            if ( first )
+            {
+                scan_class(s,last,collect_command,&chunk.commands) ;
+            }
+            else
+            {
+                scan_commands(s,last,collect_command,&chunk.commands) ;
+            }
+        }
+        catch ( pxml_scan_failed &failed )
+        {
+            chunk.failed = true ;
+            chunk.error = failed ;
+        }
+        chunk.lines = s.line - 1 ;
+    }
+
+    static void scan_worker(pxml_work *work)
+    {
+        unique_lock<mutex> locked(work->lock) ;
+        for (;;)
+        {
+            while ( work->next < work->chunks.size() && work->next >= work->handled + work->window )
+            {
+                work->chunk_handled.wait(locked) ;
+            }
+            if ( work->next >= work->chunks.size() ) return ;
+
+            size_t index = work->next++ ;
+            locked.unlock() ;
+            scan_chunk(work->chunks[index],index == 0,index + 1 == work->chunks.size()) ;
+            locked.lock() ;
+
+            work->chunks[index].done = true ;
+            work->chunk_done.notify_all() ;
+        }
+    }
+
+    static void split_chunks(const char *text,size_t length,vector<pxml_chunk> &chunks)
+    {
+        static const char tag[] = "<vm-function>" ;
+        const char *end = text + length ;
+        const char *start = text ;
+        while ( start < end )
+        {
+            const char *split = end ;
+            if ( (size_t)(end - start) > PXML_CHUNK_SIZE )
+            {
+                // std::search rather than the GNU memmem
+                split = search(start + PXML_CHUNK_SIZE,end,tag,tag + sizeof(tag) - 1) ;
+            }
+            pxml_chunk chunk ;
+            chunk.start = start ;
+            chunk.end = split ;
+            chunk.lines = 0 ;
+            chunk.failed = false ;
+            chunk.done = false ;
+            chunks.push_back(chunk) ;
+            start = split ;
+        }
+    }
+
+    static void scan_parallel(const char *text,size_t length,int threads,vm_command_handler handler,void *context)
+    {
+        pxml_work work ;
+        split_chunks(text,length,work.chunks) ;
+        work.next = 0 ;
+        work.handled = 0 ;
+        work.window = threads * PXML_CHUNK_WINDOW ;
+
+        vector<thread> workers ;
+        for ( int i = 0 ; i < threads ; i++ ) workers.push_back(thread(scan_worker,&work)) ;
+
+        int line = 1 ;
+        int index = 0 ;
+        pxml_scan_failed error = { 0, "" } ;
+        bool failed = false ;
+        for ( size_t c = 0 ; c < work.chunks.size() && !failed ; c++ )
+        {
+            pxml_chunk &chunk = work.chunks[c] ;
+            {
+                unique_lock<mutex> locked(work.lock) ;
+                while ( !chunk.done ) work.chunk_done.wait(locked) ;
+            }
+
+            for ( size_t i = 0 ; i < chunk.commands.size() ; i++ )
+            {
+                chunk.commands[i].index = index++ ;
+                handler(chunk.commands[i],context) ;
+            }
+            if ( chunk.failed )
+            {
+                failed = true ;
+                error = chunk.error ;
+                error.line += line - 1 ;
+            }
+            line += chunk.lines ;
+            vector<vm_command>().swap(chunk.commands) ;
+
+            unique_lock<mutex> locked(work.lock) ;
+            work.handled = c + 1 ;
+            work.chunk_handled.notify_all() ;
+        }
+
+        // let any workers still waiting for the window see that there is nothing left
+        {
+            unique_lock<mutex> locked(work.lock) ;
+            work.next = work.chunks.size() ;
+            work.chunk_handled.notify_all() ;
+        }
+        for ( size_t i = 0 ; i < workers.size() ; i++ ) workers[i].join() ;
+
+        if ( failed ) fatal_error(-1,"Pxml line " + to_string(error.line) + ": " + error.message + "\n") ;
+    }
+
+    void pxml_read_memory(const char *text,size_t length,vm_command_handler handler,void *context,int threads)
+    {
+        pxml_scanner s ;
+        s.p = text ;
+        s.end = text + length ;
+        s.line = 1 ;
+        s.deferred = false ;
+
+        // an empty class ends the scan however much follows it, that is left to the serial scan
+        if ( threads < 1 ) threads = thread::hardware_concurrency() ;
+        if ( threads > 1 && length >= PXML_PARALLEL_MINIMUM && !match(s,TAG("<vm-class/>")) )
+        {
+            scan_parallel(text,length,threads,handler,context) ;
+            return ;
+        }
+
+        s.p = text ;
+        s.line = 1 ;
+        scan_class(s,true,handler,context) ;
+    }
+
+    // encoding
+    static void element(string &out,const char *tag,const string &value)
+    {
+        out += "        <" ;
+        out += tag ;
+        out += ">" + value + "</" ;
+        out += tag ;
+        out += ">\n" ;
+    }
+
+    string pxml_encode(const vector<vm_command> &commands)
+    {
+        string out = "<vm-class>\n" ;
+        for ( size_t i = 0 ; i < commands.size() ; i++ )
+        {
+            const vm_command &command = commands[i] ;
+            const char *kind = vm_is_operator(command.op) ? "vm-operator" :
+                               vm_is_jump(command.op) ? "vm-jump" :
+                               vm_is_function(command.op) ? "vm-function" : "vm-stack" ;
+
+            out += "    <" + string(kind) + ">\n" ;
+            element(out,"command",vm_opcode_to_string(command.op)) ;
+            if ( vm_is_jump(command.op) || vm_is_function(command.op) ) element(out,"label",command.label) ;
+            if ( vm_is_function(command.op) ) element(out,"number",to_string(command.number)) ;
+            if ( vm_is_stack(command.op) )
+            {
+                element(out,"segment",vm_segment_to_string(command.segment)) ;
+                element(out,"offset",to_string(command.number)) ;
+            }
+            out += "    </" + string(kind) + ">\n" ;
+        }
+        out += "</vm-class>\n" ;
+        return out ;
+    }
+
+    void pxml_read_file(string path,vm_command_handler handler,void *context,int threads)
+    {
+        int fd = open(path.c_str(),O_RDONLY) ;
+        if ( fd < 0 ) fatal_error(-1,"cannot open Pxml file: " + path + "\n") ;
+
+        struct stat info ;
+        if ( fstat(fd,&info) != 0 || info.st_size == 0 )
+        {
+            close(fd) ;
+            fatal_error(-1,"cannot read Pxml file: " + path + "\n") ;
+        }
+
+        size_t length = info.st_size ;
+        void *mapped = mmap(0,length,PROT_READ,MAP_PRIVATE,fd,0) ;
+        close(fd) ;
+        if ( mapped == MAP_FAILED ) fatal_error(-1,"cannot map Pxml file: " + path + "\n") ;
+
+        pxml_read_memory((const char *)mapped,length,handler,context,threads) ;
+
+        munmap(mapped,length) ;
+    }
+}
@@ -0,0 +1,276 @@
+// parallel test driver, runs the tests the same way as bin/run-tests
+#include "iobuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+
+// Test Driver
+// a test is a non-empty NAME.sim with a NAME.Pxml beside it in one of the test directories
+// - each test runs cat NAME.Pxml | translator 2>&1 | simulator test-it 2>&1 | diff - NAME.sim as bin/run-tests does
+// - up to --jobs tests run at once, each in a child process that keeps the translator and simulator output in temporary files
+// - a child reports its test's result, the translator's wall time and output size as one line on a pipe shared by every child
+// - the results are printed in test order after the last test finishes, --timing=<file> also writes them as tab separated lines
+// - the exit status is 1 if any test fails
+//
+// all errors will result in calls to fatal_error()
+
+struct test_case
+{
+    string dir ;            // the directory holding the test
+    string name ;           // NAME of NAME.Pxml and NAME.sim
+    bool passed ;
+    double seconds ;        // translator wall time
+    long bytes ;            // translator output size, including its errors
+} ;
+
+static string translator = "" ;
+static string simulator = "bin/simulator" ;
+
+static double wall_seconds()
+{
+    struct timespec now ;
+    clock_gettime(CLOCK_MONOTONIC,&now) ;
+    return now.tv_sec + now.tv_nsec / 1e9 ;
+}
+
+static string read_text_file(string path)
+{
+    ifstream file(path.c_str(),ios::binary) ;
+    ostringstream text ;
+    text << file.rdbuf() ;
+    return text.str() ;
+}
+
+static string read_fd(int fd)
+{
+    string contents ;
+    char bytes[16384] ;
+    lseek(fd,0,SEEK_SET) ;
+    for ( ssize_t n ; (n = read(fd,bytes,sizeof(bytes))) > 0 ; ) contents.append(bytes,n) ;
+    return contents ;
+}
+
+// the tests in dir sorted by name
+static void find_tests(string dir,vector<test_case> &tests)
+{
+    DIR *directory = opendir(dir.c_str()) ;
+    if ( directory == 0 ) fatal_error(-1,"cannot open test directory: " + dir + "\n") ;
+
+    vector<string> names ;
+    for ( struct dirent *entry ; (entry = readdir(directory)) != 0 ; )
+    {
+        string file = entry->d_name ;
+        if ( file.size() <= 4 || file.compare(file.size() - 4,4,".sim") != 0 ) continue ;
+
+        string name = file.substr(0,file.size() - 4) ;
+        struct stat info ;
+        if ( stat((dir + "/" + file).c_str(),&info) != 0 || info.st_size == 0 ) continue ;
+        if ( stat((dir + "/" + name + ".Pxml").c_str(),&info) != 0 ) continue ;
+        names.push_back(name) ;
+    }
+    closedir(directory) ;
+
+    sort(names.begin(),names.end()) ;
+    for ( size_t i = 0 ; i < names.size() ; i++ )
+    {
+        test_case test = { dir, names[i], false, 0, 0 } ;
+        tests.push_back(test) ;
+    }
+}
+
+// run program with standard input from in and standard output and errors to out, waits for it to finish
+static void run_program(const char *program,const char *arg,int in,int out)
+{
+    pid_t pid = fork() ;
+    if ( pid < 0 ) return ;
+    if ( pid == 0 )
+    {
+        dup2(in,0) ;
+        dup2(out,1) ;
+        dup2(out,2) ;
+        execlp(program,program,arg,(char *)0) ;
+        _exit(127) ;
+    }
+    int status ;
+    while ( waitpid(pid,&status,0) < 0 && errno == EINTR ) ;
+}
+
+// the body of a child process, the result line is "<index> <passed> <seconds> <bytes>"
+static void run_test(int index,const test_case &test,int report)
+{
+    string path = test.dir + "/" + test.name ;
+    int input = open((path + ".Pxml").c_str(),O_RDONLY) ;
+    FILE *translated = tmpfile() ;
+    FILE *simulated = tmpfile() ;
+    bool passed = false ;
+    double seconds = 0 ;
+    long bytes = 0 ;
+
+    if ( input >= 0 && translated != 0 && simulated != 0 )
+    {
+        double start = wall_seconds() ;
+        run_program(translator.c_str(),(char *)0,input,fileno(translated)) ;
+        seconds = wall_seconds() - start ;
+
+        bytes = lseek(fileno(translated),0,SEEK_END) ;
+        lseek(fileno(translated),0,SEEK_SET) ;
+        run_program(simulator.c_str(),"test-it",fileno(translated),fileno(simulated)) ;
+
+        passed = read_fd(fileno(simulated)) == read_text_file(path + ".sim") ;
+    }
+
+    char line[128] ;
+    snprintf(line,sizeof(line),"%d %d %.6f %ld\n",index,passed ? 1 : 0,seconds,bytes) ;
+    if ( write(report,line,strlen(line)) < 0 ) _exit(1) ;
+}
+
+// run every test with at most jobs running at once
+static void run_tests(vector<test_case> &tests,int jobs)
+{
+    int report[2] ;
+    if ( pipe(report) != 0 ) fatal_error(-1,"cannot create a pipe\n") ;
+
+    size_t next = 0, finished = 0 ;
+    int running = 0 ;
+    string pending = "" ;
+    while ( finished < tests.size() )
+    {
+        while ( running < jobs && next < tests.size() )
+        {
+            pid_t pid = fork() ;
+            if ( pid < 0 ) fatal_error(-1,"cannot fork a test process\n") ;
+            if ( pid == 0 )
+            {
+                close(report[0]) ;
+                run_test(next,tests[next],report[1]) ;
+                _exit(0) ;
+            }
+            running++ ;
+            next++ ;
+        }
+
+        char bytes[4096] ;
+        ssize_t n = read(report[0],bytes,sizeof(bytes)) ;
+        if ( n < 0 && errno == EINTR ) continue ;
+        if ( n <= 0 ) fatal_error(-1,"lost the test results\n") ;
+        pending.append(bytes,n) ;
+
+        // each complete line is one finished test
+        for ( size_t end ; (end = pending.find('\n')) != string::npos ; pending.erase(0,end + 1) )
+        {
+            istringstream fields(pending.substr(0,end)) ;
+            int index, passed ;
+            fields >> index >> passed ;
+            fields >> tests[index].seconds >> tests[index].bytes ;
+            tests[index].passed = passed != 0 ;
+            running-- ;
+            finished++ ;
+        }
+        while ( waitpid(-1,0,WNOHANG) > 0 ) ;
+    }
+    while ( waitpid(-1,0,0) > 0 ) ;
+
+    close(report[0]) ;
+    close(report[1]) ;
+}
+
+static void write_timing_file(string path,const vector<test_case> &tests)
+{
+    ofstream file(path.c_str()) ;
+    file << "# test\tresult\ttranslate seconds\toutput bytes" << endl ;
+    file.setf(ios::fixed) ;
+    file.precision(6) ;
+    for ( size_t i = 0 ; i < tests.size() ; i++ )
+    {
+        file << tests[i].dir << "/" << tests[i].name << "\t" << (tests[i].passed ? "passed" : "failed") << "\t"
+             << tests[i].seconds << "\t" << tests[i].bytes << endl ;
+    }
+    if ( !file ) fatal_error(-1,"cannot write timing file: " + path + "\n") ;
+}
+
+static string format_seconds(double seconds)
+{
+    char text[32] ;
+    snprintf(text,sizeof(text),"%.3fs",seconds) ;
+    return text ;
+}
+
+// main program
+// vm-test [--jobs=<n>] [--translator=<path>] [--simulator=<path>] [--timing=<file>] [--quiet] [test directory...]
+// the default test directory is tests and the default number of jobs is the number of online processors
+int main(int argc,char **argv)
+{
+    vector<string> dirs ;
+    string timing_file = "" ;
+    bool quiet = false ;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN) ;
+
+    const char *arch = getenv("CS_ARCH") ;
+    translator = string("lib/") + (arch != 0 ? arch : "cats") + "/translator" ;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        string arg = argv[i] ;
+        if ( arg.compare(0,7,"--jobs=") == 0 ) jobs = atoi(arg.substr(7).c_str()) ;
+        else if ( arg.compare(0,13,"--translator=") == 0 ) translator = arg.substr(13) ;
+        else if ( arg.compare(0,12,"--simulator=") == 0 ) simulator = arg.substr(12) ;
+        else if ( arg.compare(0,9,"--timing=") == 0 ) timing_file = arg.substr(9) ;
+        else if ( arg == "--quiet" ) quiet = true ;
+        else if ( arg[0] == '-' )
+        {
+            fatal_error(-1,"usage: vm-test [--jobs=<n>] [--translator=<path>] [--simulator=<path>] [--timing=<file>] [--quiet] [test directory...]\n") ;
+        }
+        else dirs.push_back(arg) ;
+    }
+    if ( dirs.empty() ) dirs.push_back("tests") ;
+    if ( jobs < 1 ) jobs = 1 ;
+
+    // the same output and error buffering as bin/run-tests
+    setenv("CSTOOLS_IOBUFFER_OUTPUT","iob_buffer",1) ;
+    setenv("CSTOOLS_IOBUFFER_ERRORS","iob_buffer:iob_no_context",1) ;
+    setenv("CSTOOLS_IOBUFFER_TRACES","iob_disable",1) ;
+    setenv("CSTOOLS_IOBUFFER_LOGS","iob_disable",1) ;
+
+    vector<test_case> tests ;
+    for ( size_t i = 0 ; i < dirs.size() ; i++ ) find_tests(dirs[i],tests) ;
+
+    double start = wall_seconds() ;
+    run_tests(tests,jobs) ;
+    double wall = wall_seconds() - start ;
+
+    int failed = 0 ;
+    double translating = 0 ;
+    for ( size_t i = 0 ; i < tests.size() ; i++ )
+    {
+        const test_case &test = tests[i] ;
+        translating += test.seconds ;
+        if ( !test.passed ) failed++ ;
+        if ( quiet && test.passed ) continue ;
+        write_to_output("Checking " + test.dir + "/" + test.name + ".Pxml - " + (test.passed ? "test passed" : "test failed") +
+                        " (translate " + format_seconds(test.seconds) + ", " + to_string(test.bytes) + " bytes)\n") ;
+    }
+    if ( timing_file != "" ) write_timing_file(timing_file,tests) ;
+
+    write_to_output(to_string(tests.size()) + " tests, " + to_string(tests.size() - failed) + " passed, " + to_string(failed) +
+                    " failed, translation " + format_seconds(translating) + ", wall time " + format_seconds(wall) +
+                    " with " + to_string(jobs) + " jobs\n") ;
+    print_output() ;
+    print_errors() ;
+    return failed == 0 ? 0 : 1 ;
+}
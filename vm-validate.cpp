@@ -0,0 +1,1165 @@
+// differential validation of the translator's optimised modes
+#include "iobuffer.h"
+#include "vm-commands.h"
+#include "vm-reader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+// to make out programs a bit neater
+using namespace std ;
+
+using namespace CS_IO_Buffers ;
+using namespace Hack_Virtual_Machine ;
+
+// Validation
+// each program is translated with --asm as the baseline and again with each set of optimisation options,
+// both translations are assembled and run on the Hack executor below with identical inputs
+// - every function of a program is run as the entry function with a fixed list of argument sets
+// - calls of functions the program does not define are served by built in OS functions
+// - the runs are compared at every function entry (arguments), every return (result, temp, statics and heap),
+//   every OS call (arguments) and at exit
+// - the first difference is reported with the VM command the optimised run was executing,
+//   found from the translator's --source-map
+// - Memory.peek, Memory.poke, Math.abs and Math.multiply calls are not compared because --intrinsics replaces them
+// - with more than one file a --batch process also translates them all, each response must match a separate translation
+// - random programs are generated from a seed, a failing program is kept as rand-<seed>.vm and rand-<seed>.Pxml
+// - random programs read temp, also after calls that leave it alone, and store through that into the heap object this points to
+// - some random functions are small leaves that make no calls, --program calls them without a frame
+//
+// all errors will result in calls to fatal_error()
+
+/*****************   ASSEMBLER   ******************/
+
+#define ROM_LIMIT 30000
+#define TRAP_BASE 30000
+#define EXIT_ADDRESS 29999
+#define RAM_MASK 0x7fff
+#define HEAP_BASE 2048
+#define STACK_LIMIT 1900
+#define ARRAY_BASE 8000
+#define ARRAY_SIZE 128
+
+// how a function is called, from the source map's # frame lines
+struct call_frame
+{
+    int words ;                 // pushed by a call after the arguments, 0 for a register leaf
+    int arguments ;             // passed by every call, -1 if not known
+} ;
+
+struct hack_program
+{
+    vector<unsigned short> rom ;
+    map<int,string> functions ;     // entry address to Class.func
+    map<string,int> statics ;       // Class.n to RAM address, and any other assembler variables
+    vector<string> traps ;          // OS function names, trap address is TRAP_BASE + index
+    vector<bool> vm_jumps ;         // true for the instructions of goto and if-goto commands
+    map<string,call_frame> frames ; // functions that are not called with a full frame
+    map<int,vector<string> > label_keys ;   // ROM address to the Class.func$label profile keys of the labels there
+} ;
+
+// comp field for a = 0, the same with A replaced by M gives a = 1
+static const char *comp_names[] = { "0", "1", "-1", "D", "A", "!D", "!A", "-D", "-A", "D+1", "A+1", "D-1", "A-1",
+                                    "D+A", "D-A", "A-D", "D&A", "D|A" } ;
+static const int comp_bits[] = { 0x2a, 0x3f, 0x3a, 0x0c, 0x30, 0x0d, 0x31, 0x0f, 0x33, 0x1f, 0x37, 0x0e, 0x32,
+                                 0x02, 0x13, 0x07, 0x00, 0x15 } ;
+static const char *jump_names[] = { "", "JGT", "JEQ", "JGE", "JLT", "JNE", "JLE", "JMP" } ;
+
+static int comp_code(string comp)
+{
+    int a = 0 ;
+    if ( comp.find('M') != string::npos )
+    {
+        a = 0x40 ;
+        replace(comp.begin(),comp.end(),'M','A') ;
+    }
+    for ( int pass = 0 ; pass < 2 ; pass++ )
+    {
+        for ( size_t i = 0 ; i < sizeof(comp_bits) / sizeof(comp_bits[0]) ; i++ )
+        {
+            if ( comp == comp_names[i] ) return a | comp_bits[i] ;
+        }
+        // commutative operators may be written either way round
+        if ( comp.size() == 3 && (comp[1] == '+' || comp[1] == '&' || comp[1] == '|') ) swap(comp[0],comp[2]) ;
+    }
+    return -1 ;
+}
+
+static bool is_function_name(const string &name)
+{
+    size_t dot = name.find('.') ;
+    if ( dot == string::npos || dot == 0 || dot + 1 >= name.size() ) return false ;
+    if ( name.find_first_of(".$",dot + 1) != string::npos ) return false ;
+    return !isdigit(name[dot + 1]) ;
+}
+
+static int symbol_address(hack_program &program,map<string,int> &labels,const string &symbol,int &next_variable)
+{
+    static const char *registers[] = { "SP", "LCL", "ARG", "THIS", "THAT" } ;
+    for ( int i = 0 ; i < 5 ; i++ ) if ( symbol == registers[i] ) return i ;
+    if ( symbol == "SCREEN" ) return 16384 ;
+    if ( symbol == "KBD" ) return 24576 ;
+    if ( symbol[0] == 'R' && symbol.size() <= 3 && symbol.find_first_not_of("0123456789",1) == string::npos )
+    {
+        int r = atoi(symbol.c_str() + 1) ;
+        if ( r < 16 ) return r ;
+    }
+
+    map<string,int>::iterator label = labels.find(symbol) ;
+    if ( label != labels.end() ) return label->second ;
+
+    // a call of a function that is not defined becomes a trap
+    if ( is_function_name(symbol) )
+    {
+        for ( size_t i = 0 ; i < program.traps.size() ; i++ ) if ( program.traps[i] == symbol ) return TRAP_BASE + i ;
+        program.traps.push_back(symbol) ;
+        return TRAP_BASE + program.traps.size() - 1 ;
+    }
+
+    map<string,int>::iterator variable = program.statics.find(symbol) ;
+    if ( variable != program.statics.end() ) return variable->second ;
+    if ( next_variable >= 256 ) fatal_error(-1,"too many variables in program\n") ;
+    program.statics[symbol] = next_variable ;
+    return next_variable++ ;
+}
+
+static void assemble(string text,hack_program &program)
+{
+    vector<string> lines ;
+    map<string,int> labels ;
+    istringstream in(text) ;
+    for ( string line ; getline(in,line) ; )
+    {
+        size_t comment = line.find("//") ;
+        if ( comment != string::npos ) line.erase(comment) ;
+        line.erase(remove_if(line.begin(),line.end(),::isspace),line.end()) ;
+        if ( line.empty() ) continue ;
+        if ( line[0] == '(' )
+        {
+            string label = line.substr(1,line.size() - 2) ;
+            if ( !labels.insert(make_pair(label,(int)lines.size())).second ) fatal_error(-1,"label defined twice: " + label + "\n") ;
+            if ( is_function_name(label) ) program.functions[lines.size()] = label ;
+            continue ;
+        }
+        lines.push_back(line) ;
+    }
+    if ( lines.size() >= ROM_LIMIT ) fatal_error(-1,"program is too large to validate\n") ;
+
+    int next_variable = 16 ;
+    for ( size_t i = 0 ; i < lines.size() ; i++ )
+    {
+        string line = lines[i] ;
+        if ( line[0] == '@' )
+        {
+            string symbol = line.substr(1) ;
+            int value = isdigit(symbol[0]) ? atoi(symbol.c_str()) : symbol_address(program,labels,symbol,next_variable) ;
+            program.rom.push_back(value & 0x7fff) ;
+            continue ;
+        }
+
+        int dest = 0, jump = 0 ;
+        size_t equals = line.find('=') ;
+        if ( equals != string::npos )
+        {
+            string d = line.substr(0,equals) ;
+            if ( d.find('A') != string::npos ) dest |= 4 ;
+            if ( d.find('D') != string::npos ) dest |= 2 ;
+            if ( d.find('M') != string::npos ) dest |= 1 ;
+            line = line.substr(equals + 1) ;
+        }
+        size_t semicolon = line.find(';') ;
+        if ( semicolon != string::npos )
+        {
+            string j = line.substr(semicolon + 1) ;
+            for ( int k = 1 ; k < 8 ; k++ ) if ( j == jump_names[k] ) jump = k ;
+            if ( jump == 0 ) fatal_error(-1,"bad jump: " + lines[i] + "\n") ;
+            line = line.substr(0,semicolon) ;
+        }
+        int comp = comp_code(line) ;
+        if ( comp < 0 ) fatal_error(-1,"bad instruction: " + lines[i] + "\n") ;
+        program.rom.push_back(0xe000 | comp << 6 | dest << 3 | jump) ;
+    }
+}
+
+/*****************   EXECUTOR   ******************/
+
+// one observable event of a run
+struct observation
+{
+    char kind ;                 // 'c' function entry, 'r' return, 'o' OS call, 'x' exit,
+                                // 'l' step limit, 'b' jump outside the program, 's' stack overflow
+    string name ;
+    vector<int> values ;        // arguments or the result
+    unsigned long long state ;  // hash of temp, statics and heap at a return or exit
+    int pc ;                    // ROM address of the instruction executed before the event
+} ;
+
+struct hack_machine
+{
+    short ram[32768] ;
+    int heap ;
+    int keys ;
+    vector<observation> events ;
+    map<string,int> *profile ;  // if not 0, counts of function entries and labels reached
+} ;
+
+struct shadow_frame
+{
+    int ret ;
+    int arg ;
+    string name ;
+} ;
+
+static int alu(int comp,int x,int y)
+{
+    if ( comp & 0x20 ) x = 0 ;
+    if ( comp & 0x10 ) x = ~x ;
+    if ( comp & 0x08 ) y = 0 ;
+    if ( comp & 0x04 ) y = ~y ;
+    int out = (comp & 0x02) ? x + y : x & y ;
+    if ( comp & 0x01 ) out = ~out ;
+    return (short)out ;
+}
+
+// Class.n, other assembler variables are the translator's own cells
+static bool is_static_name(const string &name)
+{
+    size_t dot = name.find('.') ;
+    return dot != string::npos && dot + 1 < name.size() && name.find_first_not_of("0123456789",dot + 1) == string::npos ;
+}
+
+static unsigned long long state_hash(hack_program &program,hack_machine &m)
+{
+    unsigned long long hash = 14695981039346656037ULL ;
+    for ( int a = 5 ; a < 13 ; a++ ) hash = (hash ^ (unsigned short)m.ram[a]) * 1099511628211ULL ;
+    for ( map<string,int>::iterator i = program.statics.begin() ; i != program.statics.end() ; ++i )
+    {
+        if ( is_static_name(i->first) ) hash = (hash ^ (unsigned short)m.ram[i->second]) * 1099511628211ULL ;
+    }
+    for ( int a = HEAP_BASE ; a < m.heap ; a++ ) hash = (hash ^ (unsigned short)m.ram[a]) * 1099511628211ULL ;
+    for ( int a = ARRAY_BASE ; a < ARRAY_BASE + ARRAY_SIZE ; a++ ) hash = (hash ^ (unsigned short)m.ram[a]) * 1099511628211ULL ;
+    return hash ;
+}
+
+static int os_alloc(hack_machine &m,int size)
+{
+    int block = m.heap ;
+    m.heap += max(1,size) ;
+    if ( m.heap >= 16384 ) m.heap = HEAP_BASE ;
+    return block ;
+}
+
+// the OS function traps[id], the frame has been built by a call
+static int trap(hack_program &program,hack_machine &m,int id,int pc)
+{
+    short *ram = m.ram ;
+    int lcl = (unsigned short)ram[1], arg = (unsigned short)ram[2] ;
+    int n = lcl - 5 - arg ;
+    if ( n < 0 || n > 16 ) return -1 ;
+    vector<int> a ;
+    for ( int i = 0 ; i < n ; i++ ) a.push_back(ram[(arg + i) & RAM_MASK]) ;
+
+    const string &name = program.traps[id] ;
+    int r = 0 ;
+    if ( name == "Memory.alloc" || name == "Array.new" ) r = os_alloc(m,n > 0 ? a[0] : 1) ;
+    else if ( name == "Memory.peek" && n == 1 ) r = ram[a[0] & RAM_MASK] ;
+    else if ( name == "Memory.poke" && n == 2 ) ram[a[0] & RAM_MASK] = a[1] ;
+    else if ( name == "Math.multiply" && n == 2 ) r = a[0] * a[1] ;
+    else if ( name == "Math.divide" && n == 2 ) r = a[1] == 0 ? 0 : a[0] / a[1] ;
+    else if ( name == "Math.abs" && n == 1 ) r = a[0] < 0 ? -a[0] : a[0] ;
+    else if ( name == "Math.min" && n == 2 ) r = min(a[0],a[1]) ;
+    else if ( name == "Math.max" && n == 2 ) r = max(a[0],a[1]) ;
+    else if ( name == "String.new" && n == 1 )
+    {
+        r = os_alloc(m,a[0] + 2) ;
+        ram[r & RAM_MASK] = 0 ;
+        ram[(r + 1) & RAM_MASK] = a[0] ;
+    }
+    else if ( name == "String.appendChar" && n == 2 )
+    {
+        int s = a[0] & RAM_MASK ;
+        ram[(s + 2 + ram[s]) & RAM_MASK] = a[1] ;
+        ram[s]++ ;
+        r = a[0] ;
+    }
+    else if ( name == "Keyboard.keyPressed" )
+    {
+        static const int keys[] = { 0, 0, 130, 0, 132, 140, 0, 81 } ;
+        r = keys[++m.keys % 8] ;
+    }
+
+    if ( name != "Memory.peek" && name != "Memory.poke" && name != "Math.abs" && name != "Math.multiply" )
+    {
+        observation o = { 'o', name, a, 0, pc } ;
+        o.values.push_back((short)r) ;
+        m.events.push_back(o) ;
+    }
+
+    // return as the VM return command does
+    int ret = (unsigned short)ram[(lcl - 5) & RAM_MASK] ;
+    ram[arg & RAM_MASK] = r ;
+    ram[0] = arg + 1 ;
+    ram[4] = ram[(lcl - 1) & RAM_MASK] ;
+    ram[3] = ram[(lcl - 2) & RAM_MASK] ;
+    ram[2] = ram[(lcl - 3) & RAM_MASK] ;
+    ram[1] = ram[(lcl - 4) & RAM_MASK] ;
+    return ret ;
+}
+
+// the frame of function name, a full frame of 5 words unless the source map says otherwise
+static call_frame frame_of(hack_program &program,const string &name)
+{
+    map<string,call_frame>::iterator frame = program.frames.find(name) ;
+    if ( frame != program.frames.end() ) return frame->second ;
+    call_frame full = { 5, -1 } ;
+    return full ;
+}
+
+// the RAM address of the cell holding argument i of a register leaf, -1 if no leaf uses it
+static int leaf_argument(hack_program &program,int i)
+{
+    map<string,int>::iterator cell = program.statics.find("leaf..arg" + to_string(i)) ;
+    return cell == program.statics.end() ? -1 : cell->second ;
+}
+
+// run entry with args, an argument of -1 is replaced by a new 32 word object
+// the entry is called as the program calls it, a register leaf gets its arguments in cells and its return address in D
+static void execute(hack_program &program,hack_machine &m,int entry,const vector<int> &args,long long max_steps)
+{
+    memset(m.ram,0,sizeof(m.ram)) ;
+    m.heap = HEAP_BASE ;
+    m.keys = 0 ;
+    m.events.clear() ;
+
+    short *ram = m.ram ;
+    int sp = 256 ;
+    int pc = entry, last_pc = -1, a = 0, d = 0 ;
+    call_frame entry_frame = frame_of(program,program.functions[entry]) ;
+    if ( entry_frame.words == 0 )
+    {
+        for ( size_t i = 0 ; i < args.size() ; i++ )
+        {
+            int value = args[i] == -1 ? os_alloc(m,32) : args[i] ;
+            int cell = leaf_argument(program,i) ;
+            if ( cell >= 0 ) ram[cell] = value ;
+        }
+        d = EXIT_ADDRESS ;
+        ram[0] = ram[1] = ram[2] = sp ;
+    }
+    else
+    {
+        for ( size_t i = 0 ; i < args.size() ; i++ ) ram[sp++] = args[i] == -1 ? os_alloc(m,32) : args[i] ;
+        ram[sp++] = EXIT_ADDRESS ;
+        sp += entry_frame.words - 1 ;
+        ram[0] = sp ;
+        ram[1] = sp ;
+        ram[2] = sp - entry_frame.words - args.size() ;
+    }
+
+    vector<shadow_frame> frames ;
+    int rom_size = program.rom.size() ;
+    for ( long long steps = 0 ; ; steps++ )
+    {
+        if ( steps >= max_steps )
+        {
+            observation o = { 'l', "", vector<int>(), 0, last_pc } ;
+            m.events.push_back(o) ;
+            return ;
+        }
+        if ( pc == EXIT_ADDRESS )
+        {
+            observation o = { 'x', "", vector<int>(1,ram[((unsigned short)ram[0] - 1) & RAM_MASK]), state_hash(program,m), last_pc } ;
+            m.events.push_back(o) ;
+            return ;
+        }
+        if ( pc >= TRAP_BASE && pc < TRAP_BASE + (int)program.traps.size() )
+        {
+            last_pc = pc ;
+            pc = trap(program,m,pc - TRAP_BASE,last_pc) ;
+            if ( pc < 0 ) break ;
+            continue ;
+        }
+        if ( pc < 0 || pc >= rom_size ) break ;
+        if ( m.profile != 0 && program.label_keys.count(pc) > 0 )
+        {
+            vector<string> &keys = program.label_keys[pc] ;
+            for ( size_t i = 0 ; i < keys.size() ; i++ ) (*m.profile)[keys[i]]++ ;
+        }
+
+        // function entries and returns
+        if ( !frames.empty() && pc == frames.back().ret && (unsigned short)ram[0] == frames.back().arg + 1 )
+        {
+            observation o = { 'r', frames.back().name, vector<int>(1,ram[((unsigned short)ram[0] - 1) & RAM_MASK]), state_hash(program,m), last_pc } ;
+            m.events.push_back(o) ;
+            frames.pop_back() ;
+        }
+        // a loop may jump back to the start of a function with no locals, that is not an entry
+        map<int,string>::iterator function = program.functions.find(pc) ;
+        if ( function != program.functions.end() && (last_pc < 0 || (pc != last_pc + 1 && !program.vm_jumps[last_pc])) )
+        {
+            // a register leaf's result replaces its arguments, which were popped before the call
+            call_frame called = frame_of(program,function->second) ;
+            int lcl = (unsigned short)ram[1], arg = (unsigned short)ram[2] ;
+            if ( called.words == 0 ) lcl = arg = (unsigned short)ram[0] ;
+            if ( lcl >= STACK_LIMIT )
+            {
+                observation o = { 's', function->second, vector<int>(), 0, last_pc } ;
+                m.events.push_back(o) ;
+                return ;
+            }
+            observation o = { 'c', function->second, vector<int>(), 0, last_pc } ;
+            int ret = (unsigned short)d ;
+            if ( called.words == 0 )
+            {
+                for ( int i = 0 ; i < called.arguments ; i++ ) o.values.push_back(ram[leaf_argument(program,i) & RAM_MASK]) ;
+            }
+            else
+            {
+                for ( int i = arg ; i < lcl - called.words && i - arg < 16 ; i++ ) o.values.push_back(ram[i & RAM_MASK]) ;
+                ret = (unsigned short)ram[(lcl - called.words) & RAM_MASK] ;
+            }
+            m.events.push_back(o) ;
+            if ( m.profile != 0 ) (*m.profile)[function->second]++ ;
+            shadow_frame frame = { ret, arg, function->second } ;
+            frames.push_back(frame) ;
+        }
+
+        int instruction = program.rom[pc] ;
+        last_pc = pc ;
+        if ( (instruction & 0x8000) == 0 )
+        {
+            a = instruction ;
+            pc++ ;
+            continue ;
+        }
+        int comp = (instruction >> 6) & 0x3f ;
+        int y = (instruction & 0x1000) ? ram[a & RAM_MASK] : a ;
+        int out = alu(comp,d,y) ;
+        int address = a ;
+        if ( instruction & 0x0020 ) a = out & 0xffff ;
+        if ( instruction & 0x0010 ) d = out ;
+        if ( instruction & 0x0008 ) ram[address & RAM_MASK] = out ;
+        int jump = instruction & 7 ;
+        bool taken = ((jump & 4) && out < 0) || ((jump & 2) && out == 0) || ((jump & 1) && out > 0) ;
+        pc = taken ? (unsigned short)address : pc + 1 ;
+    }
+
+    observation o = { 'b', "", vector<int>(1,pc), 0, last_pc } ;
+    m.events.push_back(o) ;
+}
+
+/*****************   TRANSLATION   ******************/
+
+static string translator = "" ;
+static long long max_steps = 300000 ;
+static string temp_prefix = "" ;
+static map<string,int> known_arguments ;      // argument counts of the random functions, runs with fewer are skipped
+
+static string read_text_file(string path)
+{
+    ifstream file(path.c_str(),ios::binary) ;
+    ostringstream text ;
+    text << file.rdbuf() ;
+    return text.str() ;
+}
+
+static void write_text_file(string path,string text)
+{
+    ofstream file(path.c_str(),ios::binary) ;
+    file << text ;
+    if ( !file ) fatal_error(-1,"cannot write file: " + path + "\n") ;
+}
+
+// translate path with options, returns false if the translator failed
+static bool translate(string path,string options,string &assembly,string &source_map,string &errors)
+{
+    string asm_file = temp_prefix + ".asm", map_file = temp_prefix + ".map", errors_file = temp_prefix + ".err" ;
+    string command = translator + " " + options + " --source-map=" + map_file + " " + path +
+                     " > " + asm_file + " 2> " + errors_file ;
+    int status = system(command.c_str()) ;
+    assembly = read_text_file(asm_file) ;
+    source_map = read_text_file(map_file) ;
+    errors = read_text_file(errors_file) ;
+    return status == 0 ;
+}
+
+// mark the instructions of goto and if-goto commands using the source map
+static void find_vm_jumps(hack_program &program,const string &source_map)
+{
+    program.vm_jumps.assign(program.rom.size(),false) ;
+    istringstream in(source_map) ;
+    for ( string line ; getline(in,line) ; )
+    {
+        if ( line.empty() || line[0] == '#' ) continue ;
+        istringstream fields(line) ;
+        int start, end ;
+        string class_name, function, index, command ;
+        fields >> start >> end >> class_name >> function >> index >> command ;
+        if ( command != "goto" && command != "if-goto" ) continue ;
+        for ( int pc = start ; pc < end && pc < (int)program.rom.size() ; pc++ ) program.vm_jumps[pc] = true ;
+    }
+}
+
+// the functions that are not called with a full frame, from the # frame lines of the source map
+static void find_frames(hack_program &program,const string &source_map)
+{
+    istringstream in(source_map) ;
+    for ( string line ; getline(in,line) ; )
+    {
+        if ( line.compare(0,8,"# frame ") != 0 ) continue ;
+        istringstream fields(line.substr(8)) ;
+        string function ;
+        call_frame frame = { 5, -1 } ;
+        fields >> function >> frame.words >> frame.arguments ;
+        program.frames[function] = frame ;
+    }
+}
+
+// the profile keys of the labels at each ROM address
+static void find_label_keys(hack_program &program,const string &source_map)
+{
+    istringstream in(source_map) ;
+    for ( string line ; getline(in,line) ; )
+    {
+        if ( line.empty() || line[0] == '#' ) continue ;
+        istringstream fields(line) ;
+        int start, end ;
+        string class_name, function, index, command, label ;
+        fields >> start >> end >> class_name >> function >> index >> command >> label ;
+        if ( command == "label" ) program.label_keys[start].push_back(function + "$" + label) ;
+    }
+}
+
+// the VM command whose instructions include ROM address pc
+static string vm_command_at(const string &source_map,int pc)
+{
+    istringstream in(source_map) ;
+    for ( string line ; getline(in,line) ; )
+    {
+        if ( line.empty() || line[0] == '#' ) continue ;
+        istringstream fields(line) ;
+        int start, end ;
+        string class_name, function, index ;
+        fields >> start >> end >> class_name >> function >> index ;
+        if ( pc >= start && pc < end )
+        {
+            string text ;
+            getline(fields,text) ;
+            return function + " command " + index + ":" + text ;
+        }
+    }
+    return "a shared routine at ROM address " + to_string(pc) ;
+}
+
+static string describe(const observation &o)
+{
+    static const char *kinds[] = { "entry", "return", "OS call", "exit", "step limit", "jump outside the program", "stack overflow" } ;
+    string text = kinds[string("croxlbs").find(o.kind)] ;
+    if ( o.name != "" ) text += " " + o.name ;
+    if ( !o.values.empty() )
+    {
+        text += " (" ;
+        for ( size_t i = 0 ; i < o.values.size() ; i++ ) text += (i > 0 ? "," : "") + to_string(o.values[i]) ;
+        text += ")" ;
+    }
+    if ( o.kind == 'r' || o.kind == 'x' ) text += " state " + to_string(o.state % 1000000) ;
+    return text ;
+}
+
+static bool same_observation(const observation &a,const observation &b)
+{
+    return a.kind == b.kind && a.name == b.name && a.values == b.values && a.state == b.state ;
+}
+
+static string describe_args(const vector<int> &args)
+{
+    string text = "(" ;
+    for ( size_t i = 0 ; i < args.size() ; i++ ) text += (i > 0 ? "," : "") + (args[i] == -1 ? string("obj") : to_string(args[i])) ;
+    return text + ")" ;
+}
+
+// the argument sets every function is run with, the first number is the count
+static const int arg_sets[][5] = { { 0 }, { 1, -1 }, { 2, -1, 3 }, { 3, -1, 5, 7 }, { 4, 1500, 9, 2, 6 } } ;
+
+// runs with fewer arguments than the random function takes are skipped, as are runs of a function that
+// --program calls without a full frame with other than the number of arguments its calls pass
+static bool run_wanted(hack_program &program,const string &function,const vector<int> &args)
+{
+    map<string,int>::iterator known = known_arguments.find(function) ;
+    if ( known != known_arguments.end() && (int)args.size() < known->second ) return false ;
+    call_frame frame = frame_of(program,function) ;
+    return frame.arguments < 0 || (int)args.size() == frame.arguments ;
+}
+
+// the files named by the bare options --program, --profile and --instrument, one set for each validated file
+static map<string,int> path_ids ;
+static string path_file(const string &path,const string &suffix)
+{
+    if ( path_ids.count(path) == 0 )
+    {
+        int id = path_ids.size() ;
+        path_ids[path] = id ;
+    }
+    return temp_prefix + "-" + to_string(path_ids[path]) + suffix ;
+}
+
+// --program becomes a program of just path, --profile the profile of the baseline runs, see write_profile(),
+// and --instrument writes its manifest to a temporary file
+static string expand_options(const string &path,const string &options)
+{
+    istringstream words(options) ;
+    string expanded ;
+    for ( string word ; words >> word ; )
+    {
+        if ( word == "--program" )
+        {
+            write_text_file(path_file(path,".program"),path + "\n") ;
+            word += "=" + path_file(path,".program") ;
+        }
+        else if ( word == "--profile" ) word += "=" + path_file(path,".profile") ;
+        else if ( word == "--instrument" ) word += "=" + path_file(path,".manifest") ;
+        expanded += (expanded == "" ? "" : " ") + word ;
+    }
+    return expanded ;
+}
+
+// count the function entries and labels reached by every baseline run of path and write them as a profile
+static void write_profile(const string &path,hack_program &base,const string &base_map)
+{
+    static hack_machine m ;
+    map<string,int> counts ;
+    find_label_keys(base,base_map) ;
+    m.profile = &counts ;
+    for ( map<int,string>::iterator f = base.functions.begin() ; f != base.functions.end() ; ++f )
+    {
+        for ( int s = 0 ; s < 5 ; s++ )
+        {
+            vector<int> args(arg_sets[s] + 1,arg_sets[s] + 1 + arg_sets[s][0]) ;
+            if ( run_wanted(base,f->second,args) ) execute(base,m,f->first,args,max_steps) ;
+        }
+    }
+    m.profile = 0 ;
+
+    string text = "# function entries and labels reached by the baseline runs\n" ;
+    for ( map<string,int>::iterator c = counts.begin() ; c != counts.end() ; ++c ) text += c->first + " " + to_string(c->second) + "\n" ;
+    write_text_file(path_file(path,".profile"),text) ;
+}
+
+// compare the baseline and optimised translations of path, returns the number of runs that differ
+static int validate(string path,string options)
+{
+    string base_asm, base_map, opt_asm, opt_map, errors ;
+    if ( !translate(path,"--asm",base_asm,base_map,errors) )
+    {
+        write_to_output(path + ": skipped, the baseline translation failed\n") ;
+        return 0 ;
+    }
+    hack_program base, opt ;
+    assemble(base_asm,base) ;
+    find_vm_jumps(base,base_map) ;
+    if ( (" " + options + " ").find(" --profile ") != string::npos ) write_profile(path,base,base_map) ;
+
+    if ( !translate(path,expand_options(path,options),opt_asm,opt_map,errors) )
+    {
+        write_to_output("FAILED " + path + " " + options + ": translation failed\n" + errors) ;
+        return 1 ;
+    }
+    assemble(opt_asm,opt) ;
+    find_vm_jumps(opt,opt_map) ;
+    find_frames(opt,opt_map) ;
+
+    static hack_machine a, b ;
+    int runs = 0, failed = 0 ;
+
+    for ( map<int,string>::iterator f = base.functions.begin() ; f != base.functions.end() ; ++f )
+    {
+        int opt_entry = -1 ;
+        for ( map<int,string>::iterator g = opt.functions.begin() ; g != opt.functions.end() ; ++g )
+        {
+            if ( g->second == f->second ) opt_entry = g->first ;
+        }
+        if ( opt_entry < 0 )
+        {
+            write_to_output("FAILED " + path + " " + options + ": " + f->second + " is missing\n") ;
+            failed++ ;
+            continue ;
+        }
+
+        for ( int s = 0 ; s < 5 ; s++ )
+        {
+            vector<int> args(arg_sets[s] + 1,arg_sets[s] + 1 + arg_sets[s][0]) ;
+            if ( !run_wanted(opt,f->second,args) ) continue ;
+            execute(base,a,f->first,args,max_steps) ;
+            execute(opt,b,opt_entry,args,max_steps * 4) ;
+            runs++ ;
+
+            size_t n = min(a.events.size(),b.events.size()) ;
+            size_t i = 0 ;
+            while ( i < n && same_observation(a.events[i],b.events[i]) ) i++ ;
+            if ( i == n && a.events.size() == b.events.size() ) continue ;
+
+            // a run that stopped early is only compared as far as it got, the baseline whichever way it stopped
+            // and the optimised run only at the step limit while the baseline was still running,
+            // the optimised run jumping outside the program or overflowing the stack on its own is a failure
+            bool a_stopped = i + 1 >= a.events.size() && string("lbs").find(a.events.back().kind) != string::npos ;
+            bool b_limit = i + 1 >= b.events.size() && b.events.back().kind == 'l' && i < a.events.size() && a.events[i].kind != 'x' ;
+            if ( a_stopped || b_limit ) continue ;
+
+            failed++ ;
+            write_to_output("MISMATCH " + path + " " + options + ": " + f->second + describe_args(args) + " event " + to_string(i) + "\n") ;
+            write_to_output("    baseline:  " + (i < a.events.size() ? describe(a.events[i]) : string("nothing")) + "\n") ;
+            write_to_output("    optimised: " + (i < b.events.size() ? describe(b.events[i]) : string("nothing")) + "\n") ;
+            if ( i < b.events.size() ) write_to_output("    at " + vm_command_at(opt_map,b.events[i].pc) + "\n") ;
+        }
+    }
+
+    write_to_output(path + " " + options + ": " + to_string(runs - failed) + "/" + to_string(runs) + " runs match\n") ;
+    print_output() ;
+    return failed ;
+}
+
+/*****************   BATCH TRANSLATION   ******************/
+
+// every file is translated with every set of options by one --batch process, the files of an option set
+// one after another, and each response must match a translation of the file on its own
+static int validate_batch(const vector<string> &paths,const vector<string> &option_sets)
+{
+    string requests_file = temp_prefix + ".batch", responses_file = temp_prefix + ".responses" ;
+    string requests ;
+    vector<string> names ;
+    vector<string> expected ;
+    for ( size_t o = 0 ; o < option_sets.size() ; o++ )
+    {
+        for ( size_t p = 0 ; p < paths.size() ; p++ )
+        {
+            string asm_file = temp_prefix + ".asm" ;
+            string options = expand_options(paths[p],option_sets[o]) ;
+            string command = translator + " " + options + " " + paths[p] + " > " + asm_file + " 2> /dev/null" ;
+            string status = system(command.c_str()) == 0 ? "ok" : "error" ;
+            requests += "0 " + options + " " + paths[p] + "\n" ;
+            names.push_back(paths[p] + " " + option_sets[o]) ;
+            expected.push_back(status == "ok" ? "ok " + read_text_file(asm_file) : "error") ;
+        }
+    }
+    write_text_file(requests_file,requests) ;
+    string command = translator + " --batch < " + requests_file + " > " + responses_file + " 2> /dev/null" ;
+    if ( system(command.c_str()) != 0 ) write_to_output("batch translation exited with an error\n") ;
+
+    // response ::= status ' ' output_length ' ' errors_length '\n' output errors
+    string responses = read_text_file(responses_file) ;
+    size_t at = 0 ;
+    int failed = 0 ;
+    for ( size_t r = 0 ; r < expected.size() ; r++ )
+    {
+        string response = "missing" ;
+        size_t end = responses.find('\n',at) ;
+        if ( end != string::npos )
+        {
+            istringstream header(responses.substr(at,end - at)) ;
+            string status ;
+            size_t output_length = 0, errors_length = 0 ;
+            header >> status >> output_length >> errors_length ;
+            response = status == "ok" ? "ok " + responses.substr(end + 1,output_length) : status ;
+            at = end + 1 + output_length + errors_length ;
+        }
+        if ( response == expected[r] ) continue ;
+        failed++ ;
+        write_to_output("MISMATCH batch " + names[r] + ": the response differs from a separate translation\n") ;
+    }
+
+    write_to_output("batch: " + to_string(expected.size() - failed) + "/" + to_string(expected.size()) + " requests match\n") ;
+    print_output() ;
+    return failed ;
+}
+
+/*****************   RANDOM PROGRAMS   ******************/
+
+// a small generator so that a seed gives the same program everywhere
+static unsigned int random_state ;
+static int random_below(int n)
+{
+    random_state = random_state * 1103515245 + 12345 ;
+    return (random_state >> 16) % n ;
+}
+
+static vector<vm_command> random_program ;
+static int random_labels ;
+
+static void emit(vm_opcode op,vm_segment segment,int number,string label)
+{
+    vm_command command = { op, segment, number, label, (int)random_program.size() } ;
+    random_program.push_back(command) ;
+}
+static void emit_push(vm_segment segment,int number) { emit(vm_push,segment,number,"") ; }
+static void emit_pop(vm_segment segment,int number) { emit(vm_pop,segment,number,"") ; }
+static void emit_op(vm_opcode op) { emit(op,vm_no_segment,0,"") ; }
+
+// the shape of the function being generated
+struct random_function
+{
+    int index ;
+    int args ;
+    int locals ;                // locals that expressions may read and write
+    int counters ;              // locals reserved for loop counters, after the others
+    bool has_this ;
+    int functions ;             // calls only go to later functions so every program terminates
+    bool calls ;                // false for a small leaf that --program calls without a frame
+} ;
+
+static void random_expression(random_function &f,int depth) ;
+
+static void random_value(random_function &f)
+{
+    switch(random_below(9))
+    {
+    case 0:  if ( f.args > 0 ) { emit_push(vm_argument,random_below(f.args)) ; break ; }
+             // fall through
+    case 1:  if ( f.locals > 0 ) { emit_push(vm_local,random_below(f.locals)) ; break ; }
+             // fall through
+    case 2:
+    case 3:  emit_push(vm_static,random_below(4)) ; break ;
+    case 4:  if ( f.has_this ) { emit_push(vm_this,random_below(8)) ; break ; }
+             // fall through
+    case 5:  emit_push(vm_constant,random_below(3)) ; break ;
+    case 6:  emit_push(vm_temp,random_below(8)) ; break ;
+    default: emit_push(vm_constant,random_below(1000)) ; break ;
+    }
+}
+
+// most variables are still 0 when they are read, so half the arguments are non-zero constants that tell them apart
+static void random_argument(random_function &f,int depth)
+{
+    if ( random_below(2) ) emit_push(vm_constant,1 + random_below(100)) ;
+    else random_expression(f,depth) ;
+}
+
+static void random_expression(random_function &f,int depth)
+{
+    static const vm_opcode binary[] = { vm_add, vm_sub, vm_and, vm_or, vm_eq, vm_gt, vm_lt } ;
+    int choice = depth > 2 ? 0 : random_below(6) ;
+    switch(choice)
+    {
+    case 0:
+    case 1:
+        random_value(f) ;
+        break ;
+    case 2:
+        random_expression(f,depth + 1) ;
+        emit_op(random_below(2) ? vm_neg : vm_not) ;
+        break ;
+    case 3:
+        if ( f.calls && f.index + 1 < f.functions )
+        {
+            int callee = f.index + 1 + random_below(f.functions - f.index - 1) ;
+            int args = callee % 3 ;
+            for ( int i = 0 ; i < args ; i++ ) random_argument(f,depth + 1) ;
+            emit(vm_call,vm_no_segment,args,"Rand.f" + to_string(callee)) ;
+            break ;
+        }
+        // fall through
+    case 4:
+        if ( f.calls )
+        {
+            random_expression(f,depth + 1) ;
+            random_expression(f,depth + 1) ;
+            emit(vm_call,vm_no_segment,2,random_below(2) ? "Math.multiply" : "Math.divide") ;
+            break ;
+        }
+        // fall through
+    default:
+        random_expression(f,depth + 1) ;
+        random_expression(f,depth + 1) ;
+        emit_op(binary[random_below(7)]) ;
+        break ;
+    }
+}
+
+static void random_statements(random_function &f,int depth,int count) ;
+
+static void random_statement(random_function &f,int depth)
+{
+    int choice = random_below(depth > 1 ? 6 : 11) ;
+    string label = "L" + to_string(random_labels++) ;
+    switch(choice)
+    {
+    case 0:
+    case 1:
+    case 2:
+        random_expression(f,0) ;
+        switch(random_below(5))
+        {
+        case 0:  if ( f.locals > 0 ) { emit_pop(vm_local,random_below(f.locals)) ; break ; }
+                 // fall through
+        case 1:  emit_pop(vm_static,random_below(4)) ; break ;
+        case 2:  if ( f.has_this ) { emit_pop(vm_this,random_below(8)) ; break ; }
+                 // fall through
+        case 3:  if ( f.args > 0 ) { emit_pop(vm_argument,random_below(f.args)) ; break ; }
+                 // fall through
+        default: emit_pop(vm_temp,random_below(8)) ; break ;
+        }
+        break ;
+    case 3:
+        // a[i] = value through that, a is the array or the heap object this points to
+        switch ( f.has_this ? random_below(3) : 0 )
+        {
+        case 0:
+            emit_push(vm_constant,100 + random_below(20)) ;
+            emit_push(vm_constant,ARRAY_BASE) ;
+            emit_op(vm_add) ;
+            break ;
+        case 1:
+            emit_push(vm_pointer,0) ;
+            emit_push(vm_constant,random_below(8)) ;
+            emit_op(vm_add) ;
+            break ;
+        default:
+            // that and this point to the same object, the fields are written through one and read through the other
+            emit_push(vm_pointer,0) ;
+            emit_pop(vm_pointer,1) ;
+            random_expression(f,1) ;
+            emit_pop(vm_that,random_below(8)) ;
+            emit_push(vm_that,random_below(8)) ;
+            emit_push(vm_this,random_below(8)) ;
+            emit_op(vm_add) ;
+            emit_pop(vm_this,random_below(8)) ;
+            return ;
+        }
+        random_expression(f,1) ;
+        emit_pop(vm_temp,0) ;
+        emit_pop(vm_pointer,1) ;
+        emit_push(vm_temp,0) ;
+        emit_pop(vm_that,0) ;
+        break ;
+    case 4:
+        // a string literal
+        if ( !f.calls ) break ;
+        emit_push(vm_constant,3) ;
+        emit(vm_call,vm_no_segment,1,"String.new") ;
+        for ( int i = 0 ; i < 3 ; i++ )
+        {
+            emit_push(vm_constant,65 + random_below(26)) ;
+            emit(vm_call,vm_no_segment,2,"String.appendChar") ;
+        }
+        emit_pop(vm_static,random_below(4)) ;
+        break ;
+    case 5:
+        // a value kept in temp across a call and read back, the callee may or may not change it
+        if ( !f.calls ) break ;
+        random_expression(f,0) ;
+        {
+            int k = random_below(8) ;
+            emit_pop(vm_temp,k) ;
+            if ( f.index + 1 < f.functions )
+            {
+                int callee = f.index + 1 + random_below(f.functions - f.index - 1) ;
+                for ( int i = 0 ; i < callee % 3 ; i++ ) random_argument(f,1) ;
+                emit(vm_call,vm_no_segment,callee % 3,"Rand.f" + to_string(callee)) ;
+            }
+            else
+            {
+                random_expression(f,1) ;
+                random_expression(f,1) ;
+                emit(vm_call,vm_no_segment,2,"Math.max") ;
+            }
+            emit_push(vm_temp,k) ;
+            emit_op(vm_add) ;
+        }
+        emit_pop(vm_static,random_below(4)) ;
+        break ;
+    case 6:
+    case 7:
+        // if
+        random_expression(f,0) ;
+        emit(vm_if_goto,vm_no_segment,0,label + "T") ;
+        random_statements(f,depth + 1,random_below(3)) ;
+        emit(vm_goto,vm_no_segment,0,label + "E") ;
+        emit(vm_label,vm_no_segment,0,label + "T") ;
+        random_statements(f,depth + 1,1 + random_below(3)) ;
+        if ( random_below(4) == 0 )
+        {
+            random_expression(f,0) ;
+            emit_op(vm_return) ;
+        }
+        emit(vm_label,vm_no_segment,0,label + "E") ;
+        break ;
+    case 8:
+        // an else if chain testing one value against constants, like a switch, only at the outer level to bound the program size
+        if ( depth > 0 ) break ;
+        {
+            vm_segment segment = f.locals > 0 ? vm_local : vm_static ;
+            int number = random_below(segment == vm_local ? f.locals : 4) ;
+            int cases = 2 + random_below(5) ;
+            int base = random_below(2) ? 0 : random_below(200) ;
+            if ( random_below(2) )
+            {
+                emit_push(vm_constant,base + random_below(cases * 2)) ;
+                emit_pop(segment,number) ;
+            }
+            for ( int i = 0 ; i < cases ; i++ )
+            {
+                string test = label + "C" + to_string(i) ;
+                emit_push(segment,number) ;
+                emit_push(vm_constant,base + random_below(cases * 2)) ;
+                emit_op(vm_eq) ;
+                emit(vm_if_goto,vm_no_segment,0,test + "T") ;
+                emit(vm_goto,vm_no_segment,0,test + "F") ;
+                emit(vm_label,vm_no_segment,0,test + "T") ;
+                random_statements(f,depth + 1,1 + random_below(2)) ;
+                emit(vm_goto,vm_no_segment,0,label + "E") ;
+                emit(vm_label,vm_no_segment,0,test + "F") ;
+            }
+            random_statements(f,depth + 1,random_below(2)) ;
+            emit(vm_label,vm_no_segment,0,label + "E") ;
+        }
+        break ;
+    default:
+        // a counted loop
+        if ( f.counters == 0 ) break ;
+        {
+            int counter = f.locals + f.counters - 1 ;
+            f.counters-- ;
+            emit_push(vm_constant,1 + random_below(6)) ;
+            emit_pop(vm_local,counter) ;
+            emit(vm_label,vm_no_segment,0,label + "L") ;
+            emit_push(vm_local,counter) ;
+            emit_push(vm_constant,0) ;
+            emit_op(vm_eq) ;
+            emit(vm_if_goto,vm_no_segment,0,label + "X") ;
+            random_statements(f,depth + 1,1 + random_below(4)) ;
+            emit_push(vm_local,counter) ;
+            emit_push(vm_constant,1) ;
+            emit_op(vm_sub) ;
+            emit_pop(vm_local,counter) ;
+            emit(vm_goto,vm_no_segment,0,label + "L") ;
+            emit(vm_label,vm_no_segment,0,label + "X") ;
+            f.counters++ ;
+        }
+        break ;
+    }
+}
+
+static void random_statements(random_function &f,int depth,int count)
+{
+    for ( int i = 0 ; i < count ; i++ ) random_statement(f,depth) ;
+}
+
+static void generate_random_program(unsigned int seed)
+{
+    random_state = seed ;
+    random_program.clear() ;
+    random_labels = 0 ;
+    known_arguments.clear() ;
+
+    int functions = 2 + random_below(4) ;
+    for ( int index = 0 ; index < functions ; index++ )
+    {
+        random_function f = { index, index % 3, random_below(4), 3, random_below(2) == 0, functions, true } ;
+        if ( random_below(3) == 0 )
+        {
+            // a leaf, with few enough locals for --program to call it without a frame
+            f.locals = random_below(2) ;
+            f.counters = 2 ;
+            f.has_this = false ;
+            f.calls = false ;
+        }
+        known_arguments["Rand.f" + to_string(index)] = f.args ;
+        emit(vm_function,vm_no_segment,f.locals + f.counters,"Rand.f" + to_string(index)) ;
+        if ( f.has_this )
+        {
+            emit_push(vm_constant,8) ;
+            emit(vm_call,vm_no_segment,1,"Memory.alloc") ;
+            emit_pop(vm_pointer,0) ;
+        }
+        random_statements(f,0,2 + random_below(6)) ;
+        random_expression(f,0) ;
+        emit_op(vm_return) ;
+    }
+}
+
+static string vm_text(const vector<vm_command> &commands)
+{
+    string text ;
+    for ( size_t i = 0 ; i < commands.size() ; i++ ) text += vm_command_to_string(commands[i]) + "\n" ;
+    return text ;
+}
+
+// main program
+// vm-validate [--translator=<path>] [--steps=<n>] [--random=<count>] [--seed=<n>] [--options=<options>]... [file.Pxml...]
+// every file, then count random programs, are validated against every set of options
+// the default option sets are the optimisation levels and the individual --asm optimisations
+// the exit status is 1 if any run differs
+int main(int argc,char **argv)
+{
+    vector<string> option_sets ;
+    vector<string> paths ;
+    int random_programs = 0 ;
+    unsigned int seed = 1 ;
+
+    const char *arch = getenv("CS_ARCH") ;
+    translator = string("lib/") + (arch != 0 ? arch : "cats") + "/translator" ;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        string arg = argv[i] ;
+        if ( arg.compare(0,13,"--translator=") == 0 ) translator = arg.substr(13) ;
+        else if ( arg.compare(0,8,"--steps=") == 0 ) max_steps = atoll(arg.substr(8).c_str()) ;
+        else if ( arg.compare(0,9,"--random=") == 0 ) random_programs = atoi(arg.substr(9).c_str()) ;
+        else if ( arg.compare(0,7,"--seed=") == 0 ) seed = strtoul(arg.substr(7).c_str(),0,10) ;
+        else if ( arg.compare(0,10,"--options=") == 0 ) option_sets.push_back(arg.substr(10)) ;
+        else if ( arg[0] == '-' )
+        {
+            fatal_error(-1,"usage: vm-validate [--translator=<path>] [--steps=<n>] [--random=<count>] [--seed=<n>] [--options=<options>]... [file.Pxml...]\n") ;
+        }
+        else paths.push_back(arg) ;
+    }
+    if ( option_sets.empty() )
+    {
+        const char *defaults[] = { "-O1 --asm", "-O2", "-Os", "--asm --hoist", "--asm --forward-stores", "--asm --cache-fields",
+                                   "--asm --string-tables", "--asm --shared-returns=function", "--asm --prologue=size", "--asm --intrinsics",
+                                   "--asm --jump-tables", "--asm --program", "-O2 --program", "-Os --program", "-O2 --profile",
+                                   "--asm --instrument --instrument-labels" } ;
+        for ( size_t i = 0 ; i < sizeof(defaults) / sizeof(defaults[0]) ; i++ ) option_sets.push_back(defaults[i]) ;
+    }
+
+    char temp_dir[] = "/tmp/vm-validate-XXXXXX" ;
+    if ( mkdtemp(temp_dir) == 0 ) fatal_error(-1,"cannot create a temporary directory\n") ;
+    temp_prefix = string(temp_dir) + "/out" ;
+
+    int failed = 0 ;
+    for ( size_t p = 0 ; p < paths.size() ; p++ )
+    {
+        for ( size_t o = 0 ; o < option_sets.size() ; o++ ) failed += validate(paths[p],option_sets[o]) ;
+    }
+
+    int random_failed = 0 ;
+    for ( int r = 0 ; r < random_programs ; r++ )
+    {
+        generate_random_program(seed + r) ;
+        string path = string(temp_dir) + "/rand.Pxml" ;
+        write_text_file(path,pxml_encode(random_program)) ;
+
+        int before = random_failed ;
+        for ( size_t o = 0 ; o < option_sets.size() ; o++ ) random_failed += validate(path,option_sets[o]) ;
+        if ( random_failed > before )
+        {
+            string name = "rand-" + to_string(seed + r) ;
+            write_text_file(name + ".vm",vm_text(random_program)) ;
+            write_text_file(name + ".Pxml",pxml_encode(random_program)) ;
+            write_to_output("random program kept as " + name + ".vm and " + name + ".Pxml\n") ;
+        }
+    }
+    failed += random_failed ;
+    if ( paths.size() > 1 ) failed += validate_batch(paths,option_sets) ;
+
+    string remove = "rm -rf " + string(temp_dir) ;
+    if ( system(remove.c_str()) != 0 ) write_to_errors("cannot remove " + string(temp_dir) + "\n") ;
+
+    write_to_output(failed == 0 ? "all runs match\n" : to_string(failed) + " runs differ\n") ;
+    print_output() ;
+    print_errors() ;
+    return failed == 0 ? 0 : 1 ;
+}